@@ -0,0 +1,109 @@
+#include "affinity.h"
+#include "utils.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+void affinity_init(affinity_t *aff) {
+  memset(aff, 0, sizeof(*aff));
+  if (sched_getaffinity(0, sizeof(aff->set), &aff->set) < 0)
+    CPU_ZERO(&aff->set);
+  aff->allowed = aff->set;
+}
+
+bool affinity_parse(const char *spec, affinity_t *aff) {
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+    return false;
+
+  aff->count = 0;
+  CPU_ZERO(&aff->set);
+
+  const char *p = spec;
+  while (*p) {
+    char *end;
+    long lo = strtol(p, &end, 10);
+    long hi = lo;
+    if (end == p)
+      return false;
+    if (*end == '-') {
+      p = end + 1;
+      hi = strtol(p, &end, 10);
+      if (end == p)
+        return false;
+    }
+    if (lo < 0 || hi < lo || hi >= CPU_SETSIZE)
+      return false;
+
+    for (long cpu = lo; cpu <= hi; cpu++) {
+      if (!CPU_ISSET(cpu, &allowed)) {
+        log_error("CPU %ld is not available to this process", cpu);
+        return false;
+      }
+      if (!CPU_ISSET(cpu, &aff->set)) {
+        CPU_SET(cpu, &aff->set);
+        aff->cpus[aff->count++] = (int)cpu;
+      }
+    }
+
+    if (*end == ',')
+      end++;
+    else if (*end)
+      return false;
+    p = end;
+  }
+
+  return aff->count > 0;
+}
+
+bool affinity_pin_self(int cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+
+  int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (rc != 0) {
+    log_error("Cannot pin thread to CPU %d: %s", cpu, strerror(rc));
+    return false;
+  }
+  return true;
+}
+
+bool affinity_restore_self(const affinity_t *aff, int cpu) {
+  if (cpu >= 0)
+    return affinity_pin_self(cpu);
+  if (CPU_COUNT(&aff->allowed) == 0)
+    return true;
+
+  int rc = pthread_setaffinity_np(pthread_self(), sizeof(aff->allowed),
+                                  &aff->allowed);
+  if (rc != 0) {
+    log_error("Cannot restore thread mask: %s", strerror(rc));
+    return false;
+  }
+  return true;
+}
+
+void affinity_thread_attr(const affinity_t *aff, int cpu,
+                          pthread_attr_t *attr) {
+  cpu_set_t set;
+  if (cpu >= 0) {
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+  } else if (CPU_COUNT(&aff->allowed) > 0) {
+    set = aff->allowed;
+  } else {
+    return;
+  }
+  pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+}
+
+int affinity_incoming_cpu(int fd) {
+  int cpu = -1;
+  socklen_t len = sizeof(cpu);
+  if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) < 0)
+    return -1;
+  return cpu;
+}
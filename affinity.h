@@ -0,0 +1,41 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// NUMA placement relies on the kernel's first-touch policy: a thread
+// created on its CPU gets its stack (and the request buffers on it) on
+// the local node, and memory the pinned acceptor allocates lands on its
+// node. Every thread is created with an explicit mask so none inherits
+// another thread's pin.
+
+typedef struct {
+  int cpus[CPU_SETSIZE]; // Workers are pinned round-robin over this list
+  size_t count;          // 0: workers float
+  cpu_set_t set;         // CPUs a worker may run on (steering targets)
+  cpu_set_t allowed;     // Process mask at startup, for floating threads
+  bool steer;            // Follow each connection's SO_INCOMING_CPU
+} affinity_t;
+
+// Parse a cpulist such as "0-3,8,10-11". Every CPU must be online and in
+// this process's allowed set.
+bool affinity_parse(const char *spec, affinity_t *aff);
+
+// Default: unpinned, steering over the process's allowed CPUs.
+void affinity_init(affinity_t *aff);
+
+bool affinity_pin_self(int cpu);
+// Back to cpu alone, or to the startup mask if cpu is -1.
+bool affinity_restore_self(const affinity_t *aff, int cpu);
+
+// Set attr's mask: cpu alone, or the startup mask if cpu is -1.
+void affinity_thread_attr(const affinity_t *aff, int cpu,
+                          pthread_attr_t *attr);
+
+// CPU that processed the connection's packets, or -1 if unknown.
+int affinity_incoming_cpu(int fd);
+
+#endif
@@ -2,6 +2,7 @@
 #define CONFIG_H
 
 #define SERVER_PORT 8080
+#define SERVER_NAME "server" // Server header value
 #define SERVER_BACKLOG 128
 
 #define QUEUE_CAPACITY 1024
@@ -10,12 +11,46 @@
 #define THREAD_MAX 32
 #define THREAD_IDLE_MS 60000
 
+#define LANE_BULK_MIN (1024 * 1024)
+#define LANE_BULK_THREADS 4
+#define LANE_SLICE_BYTES (1024 * 1024)
+#define LANE_STALL_MS 30000 // Drop bulk transfers whose client stops reading
+
 #define KEEPALIVE_TIMEOUT_MS 5000
 #define KEEPALIVE_MAX_REQ 100
+#define HTTP_DRAIN_POLL_MS 100
+#define HTTP_HEAD_TIMEOUT_MS 5000 // Whole head, from its first bytes
+
+#define H2_MAX_STREAMS 100   // SETTINGS_MAX_CONCURRENT_STREAMS
+#define H2_MAX_REQUESTS 1000 // Streams per connection before GOAWAY
+#define H2_FRAME_SIZE 16384  // Largest frame we accept
+#define H2_HEADER_BLOCK (16 * 1024)
+
+#define PROXY_MAX_ROUTES 16
+#define PROXY_POOL_SIZE 32 // Idle keep-alive connections per upstream
+#define PROXY_CONNECT_MS 3000
+#define PROXY_TIMEOUT_MS 30000
+
+#define UPGRADE_READY_MS 10000
+#define UPGRADE_DRAIN_MS 30000
+#define SHUTDOWN_DRAIN_MS 10000
 
 #define BUFFER_SIZE 8192
 #define PATH_MAX_LEN 4096
 
 #define LOG_BUF_SIZE 256
 
+#define TRACE_RING_SIZE 64
+#define TRACE_SLOW_LOG_PER_SEC 10
+
+#define PACK_INLINE_MAX (64 * 1024)
+
+#define IO_FADVISE_MIN (1024 * 1024)
+#define IO_READAHEAD_WINDOW (4 * 1024 * 1024)
+#define IO_SPLICE_CHUNK (64 * 1024) // Default pipe capacity
+#define IO_SPLICE_TIMEOUT_MS 30000
+
+#define PREWARM_THREADS 8
+#define PREWARM_MAX_FILE (1024 * 1024)
+
 #endif
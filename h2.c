@@ -0,0 +1,847 @@
+#include "h2.h"
+#include "config.h"
+#include "hpack.h"
+#include "io.h"
+#include "path.h"
+#include "proxy.h"
+#include "response.h"
+#include "trace.h"
+#include "utils.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define PREFACE_LEN (sizeof(PREFACE) - 1)
+#define FRAME_HEADER_LEN 9
+#define DEFAULT_WINDOW 65535
+#define DEFAULT_FRAME_SIZE 16384
+#define WINDOW_MAX 0x7fffffff
+
+enum {
+  FRAME_DATA,
+  FRAME_HEADERS,
+  FRAME_PRIORITY,
+  FRAME_RST_STREAM,
+  FRAME_SETTINGS,
+  FRAME_PUSH_PROMISE,
+  FRAME_PING,
+  FRAME_GOAWAY,
+  FRAME_WINDOW_UPDATE,
+  FRAME_CONTINUATION
+};
+
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED 0x8
+#define FLAG_PRIORITY 0x20
+
+enum {
+  SETTINGS_HEADER_TABLE_SIZE = 1,
+  SETTINGS_ENABLE_PUSH,
+  SETTINGS_MAX_CONCURRENT_STREAMS,
+  SETTINGS_INITIAL_WINDOW_SIZE,
+  SETTINGS_MAX_FRAME_SIZE,
+  SETTINGS_MAX_HEADER_LIST_SIZE
+};
+
+enum {
+  H2_NO_ERROR,
+  H2_PROTOCOL_ERROR,
+  H2_INTERNAL_ERROR,
+  H2_FLOW_CONTROL_ERROR,
+  H2_SETTINGS_TIMEOUT,
+  H2_STREAM_CLOSED,
+  H2_FRAME_SIZE_ERROR,
+  H2_REFUSED_STREAM,
+  H2_CANCEL,
+  H2_COMPRESSION_ERROR,
+  H2_CONNECT_ERROR,
+  H2_ENHANCE_YOUR_CALM
+};
+
+// Streams only exist from the request's HEADERS until our END_STREAM;
+// request bodies are not used, so the client's half is never tracked.
+typedef struct {
+  uint32_t id; // 0 for a free slot
+  int status;
+  int64_t window; // Send window, negative after a SETTINGS shrink
+  http_body_t body;
+  size_t sent;
+  trace_req_t trace;
+} h2_stream_t;
+
+typedef struct {
+  int fd;
+  bool preface; // Client preface received
+  bool goaway;  // No new streams; finish once the last one completes
+  bool closed;  // Peer gone or connection error sent
+  hpack_table_t decoder;
+  hpack_table_t encoder;
+  h2_stream_t streams[H2_MAX_STREAMS];
+  size_t active;
+  size_t cursor; // Round-robin start for the next DATA round
+  uint32_t last_stream;
+  uint32_t requests;
+  int64_t window; // Connection send window
+  uint32_t initial_window;
+  uint32_t max_frame;
+  uint32_t block_stream; // Header block awaiting CONTINUATION, or 0
+  bool block_end_stream; // Its HEADERS frame carried END_STREAM
+  size_t block_len;
+  uint8_t block[H2_HEADER_BLOCK];
+  size_t in_len;
+  uint8_t in[2 * (FRAME_HEADER_LEN + H2_FRAME_SIZE)];
+} h2_conn_t;
+
+typedef struct {
+  http_request_t req;
+  bool has_method;
+  bool has_path;
+  bool malformed;
+} h2_request_t;
+
+static uint32_t get_u32(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+         p[3];
+}
+
+static void put_u32(uint8_t *p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+static void put_frame_header(uint8_t *p, size_t len, uint8_t type,
+                             uint8_t flags, uint32_t stream) {
+  p[0] = len >> 16;
+  p[1] = len >> 8;
+  p[2] = len;
+  p[3] = type;
+  p[4] = flags;
+  put_u32(p + 5, stream & WINDOW_MAX);
+}
+
+static bool send_frame(h2_conn_t *c, uint8_t type, uint8_t flags,
+                       uint32_t stream, const void *payload, size_t len) {
+  uint8_t header[FRAME_HEADER_LEN];
+  put_frame_header(header, len, type, flags, stream);
+
+  struct iovec iov[2] = {
+      {.iov_base = header, .iov_len = sizeof(header)},
+      {.iov_base = (void *)payload, .iov_len = len},
+  };
+  if (io_send_iov(c->fd, iov, 2, false) != (ssize_t)(sizeof(header) + len)) {
+    c->closed = true;
+    return false;
+  }
+  return true;
+}
+
+static void send_goaway(h2_conn_t *c, uint32_t code) {
+  uint8_t payload[8];
+  put_u32(payload, c->last_stream);
+  put_u32(payload + 4, code);
+  send_frame(c, FRAME_GOAWAY, 0, 0, payload, sizeof(payload));
+  c->goaway = true;
+}
+
+static void conn_error(h2_conn_t *c, uint32_t code) {
+  send_goaway(c, code);
+  c->closed = true;
+}
+
+static void send_rst(h2_conn_t *c, uint32_t stream, uint32_t code) {
+  uint8_t payload[4];
+  put_u32(payload, code);
+  send_frame(c, FRAME_RST_STREAM, 0, stream, payload, sizeof(payload));
+}
+
+static void send_window_update(h2_conn_t *c, uint32_t stream, uint32_t inc) {
+  uint8_t payload[4];
+  put_u32(payload, inc);
+  send_frame(c, FRAME_WINDOW_UPDATE, 0, stream, payload, sizeof(payload));
+}
+
+static h2_stream_t *stream_find(h2_conn_t *c, uint32_t id) {
+  for (size_t i = 0; i < H2_MAX_STREAMS; i++) {
+    if (c->streams[i].id == id)
+      return &c->streams[i];
+  }
+  return NULL;
+}
+
+// done: the whole response went out; otherwise it is traced as aborted.
+static void stream_close(h2_conn_t *c, h2_stream_t *s, bool done) {
+  trace_req_finish(&s->trace, done ? s->status : TRACE_ABORTED);
+  if (s->body.owns_fd)
+    close(s->body.fd);
+  s->id = 0;
+  c->active--;
+}
+
+typedef struct {
+  uint8_t *p;
+  size_t len;
+  size_t cap;
+  bool ok;
+} h2_block_t;
+
+static void put_header(h2_conn_t *c, h2_block_t *b, const char *name,
+                       const char *value, size_t value_len, bool index) {
+  if (!b->ok)
+    return;
+  size_t n = hpack_encode(&c->encoder, b->p + b->len, b->cap - b->len, name,
+                          value, value_len, index);
+  b->ok = n > 0;
+  b->len += n;
+}
+
+// Values that repeat across responses (types, encodings) are added to the
+// dynamic table so later responses send them as one byte.
+static bool send_headers(h2_conn_t *c, h2_stream_t *s, bool end_stream,
+                         bool more) {
+  uint8_t frame[FRAME_HEADER_LEN + 512];
+  h2_block_t b = {.p = frame + FRAME_HEADER_LEN,
+                  .cap = sizeof(frame) - FRAME_HEADER_LEN,
+                  .ok = true};
+  const http_body_t *body = &s->body;
+  char num[24];
+  char *end = num + sizeof(num);
+  char *digits = response_u64(end, s->status);
+  char date[RESPONSE_DATE_LEN];
+
+  b.len = hpack_encode_begin(&c->encoder, b.p, b.cap);
+  put_header(c, &b, ":status", digits, end - digits, false);
+  put_header(c, &b, "server", SERVER_NAME, sizeof(SERVER_NAME) - 1, true);
+  if (response_date(date))
+    put_header(c, &b, "date", date, sizeof(date), false);
+  if (s->status != 304) {
+    put_header(c, &b, "content-type", body->mime, body->mime_len, true);
+    digits = response_u64(end, body->length);
+    put_header(c, &b, "content-length", digits, end - digits, false);
+  }
+  if (body->etag)
+    put_header(c, &b, "etag", body->etag, body->etag_len, false);
+  if (body->gzip)
+    put_header(c, &b, "content-encoding", "gzip", 4, true);
+  if (body->vary)
+    put_header(c, &b, "vary", "accept-encoding", 15, true);
+
+  if (!b.ok) {
+    // The encoder table may already hold part of this block
+    conn_error(c, H2_INTERNAL_ERROR);
+    return false;
+  }
+
+  uint8_t flags = FLAG_END_HEADERS | (end_stream ? FLAG_END_STREAM : 0);
+  put_frame_header(frame, b.len, FRAME_HEADERS, flags, s->id);
+  size_t len = FRAME_HEADER_LEN + b.len;
+  ssize_t sent = more ? io_send_more(c->fd, frame, len)
+                      : io_send_buffer(c->fd, frame, len);
+  if (sent != (ssize_t)len) {
+    c->closed = true;
+    return false;
+  }
+  return true;
+}
+
+static void stream_start(h2_conn_t *c, uint32_t id,
+                         const http_request_t *req) {
+  h2_stream_t *s = stream_find(c, 0);
+  *s = (h2_stream_t){.id = id, .status = 200, .window = c->initial_window};
+  s->body.fd = -1;
+  c->active++;
+  c->requests++;
+  TRACE_PROBE2(parse_done, c->fd, req->path);
+  trace_req_open(&s->trace, c->fd, req->method, req->path);
+
+  bool head = strcmp(req->method, "HEAD") == 0;
+  char safe_path[PATH_MAX_LEN];
+  bool resolved = path_normalize(req->path, safe_path, sizeof(safe_path));
+  trace_req_stage(&s->trace, TRACE_RESOLVED);
+  if (!resolved)
+    s->status = 403;
+  else if (proxy_match(safe_path))
+    s->status = 421; // Proxied over HTTP/1.1 only; clients may retry there
+  else if (strcmp(req->method, "GET") != 0 && !head)
+    s->status = 405;
+  else
+    s->status = http_resolve(safe_path, req->accept_gzip, &s->body);
+  trace_req_stage(&s->trace, TRACE_OPENED);
+
+  if (s->status == 200 && s->body.etag && req->if_none_match[0] &&
+      strlen(req->if_none_match) == s->body.etag_len &&
+      memcmp(req->if_none_match, s->body.etag, s->body.etag_len) == 0) {
+    s->status = 304;
+    s->body.length = 0;
+  }
+
+  if (s->status != 200 && s->status != 304) {
+    const char *msg = response_reason(s->status);
+    s->body = (http_body_t){.fd = -1,
+                            .data = msg,
+                            .length = strlen(msg),
+                            .mime = "text/plain",
+                            .mime_len = 10};
+  }
+
+  bool end_stream = head || s->body.length == 0;
+  bool more = !end_stream && s->window > 0 && c->window > 0;
+  trace_req_stage(&s->trace, TRACE_SEND_START);
+  bool sent = send_headers(c, s, end_stream, more);
+  if (!sent || end_stream) {
+    TRACE_PROBE3(send_done, c->fd, sent ? s->status : TRACE_ABORTED, 0);
+    stream_close(c, s, sent);
+  }
+}
+
+static bool name_is(const char *name, size_t len, const char *lit) {
+  return len == strlen(lit) && memcmp(name, lit, len) == 0;
+}
+
+static void on_header(void *ctx, const char *name, size_t name_len,
+                      const char *value, size_t value_len) {
+  h2_request_t *r = ctx;
+
+  if (name_is(name, name_len, ":method")) {
+    r->has_method = true;
+    if (value_len >= sizeof(r->req.method))
+      r->malformed = true;
+    else
+      memcpy(r->req.method, value, value_len);
+  } else if (name_is(name, name_len, ":path")) {
+    r->has_path = true;
+    if (value_len == 0 || value_len >= sizeof(r->req.path))
+      r->malformed = true;
+    else
+      memcpy(r->req.path, value, value_len);
+  } else if (name_is(name, name_len, "accept-encoding")) {
+    r->req.accept_gzip = memmem(value, value_len, "gzip", 4) != NULL;
+  } else if (name_is(name, name_len, "if-none-match") &&
+             value_len < sizeof(r->req.if_none_match)) {
+    memcpy(r->req.if_none_match, value, value_len);
+  }
+}
+
+static void finish_block(h2_conn_t *c) {
+  uint32_t id = c->block_stream;
+  c->block_stream = 0;
+
+  // Every block must be decoded to keep the table in step with the peer
+  h2_request_t r = {0};
+  if (hpack_decode(&c->decoder, c->block, c->block_len, on_header, &r) < 0) {
+    conn_error(c, H2_COMPRESSION_ERROR);
+    return;
+  }
+
+  // Stream ids only grow; an old id may carry nothing but trailers, which
+  // end the stream and have no pseudo-headers. Those are ignored.
+  if (id <= c->last_stream) {
+    if (!c->block_end_stream || r.has_method || r.has_path)
+      conn_error(c, H2_PROTOCOL_ERROR);
+    return;
+  }
+  // New streams after our GOAWAY: ignored
+  if (c->goaway)
+    return;
+  c->last_stream = id;
+
+  if (r.malformed || !r.has_method || !r.has_path) {
+    send_rst(c, id, H2_PROTOCOL_ERROR);
+    return;
+  }
+  if (c->active == H2_MAX_STREAMS) {
+    send_rst(c, id, H2_REFUSED_STREAM);
+    return;
+  }
+
+  stream_start(c, id, &r.req);
+  if (c->requests >= H2_MAX_REQUESTS && !c->goaway)
+    send_goaway(c, H2_NO_ERROR);
+}
+
+static void on_headers(h2_conn_t *c, uint8_t flags, uint32_t stream,
+                       const uint8_t *p, size_t len) {
+  if (stream == 0 || !(stream & 1)) {
+    conn_error(c, H2_PROTOCOL_ERROR);
+    return;
+  }
+
+  size_t pad = 0;
+  if (flags & FLAG_PADDED) {
+    if (len < 1) {
+      conn_error(c, H2_PROTOCOL_ERROR);
+      return;
+    }
+    pad = p[0];
+    p++;
+    len--;
+  }
+  if (flags & FLAG_PRIORITY) {
+    if (len < 5) {
+      conn_error(c, H2_PROTOCOL_ERROR);
+      return;
+    }
+    p += 5;
+    len -= 5;
+  }
+  if (pad > len) {
+    conn_error(c, H2_PROTOCOL_ERROR);
+    return;
+  }
+  len -= pad;
+
+  if (len > sizeof(c->block)) {
+    conn_error(c, H2_ENHANCE_YOUR_CALM);
+    return;
+  }
+  memcpy(c->block, p, len);
+  c->block_len = len;
+  c->block_stream = stream;
+  c->block_end_stream = flags & FLAG_END_STREAM;
+  if (flags & FLAG_END_HEADERS)
+    finish_block(c);
+}
+
+static void on_continuation(h2_conn_t *c, uint8_t flags, uint32_t stream,
+                            const uint8_t *p, size_t len) {
+  if (stream == 0 || stream != c->block_stream) {
+    conn_error(c, H2_PROTOCOL_ERROR);
+    return;
+  }
+  if (len > sizeof(c->block) - c->block_len) {
+    conn_error(c, H2_ENHANCE_YOUR_CALM);
+    return;
+  }
+  memcpy(c->block + c->block_len, p, len);
+  c->block_len += len;
+  if (flags & FLAG_END_HEADERS)
+    finish_block(c);
+}
+
+// Returns an error code for the GOAWAY, or H2_NO_ERROR.
+static uint32_t apply_settings(h2_conn_t *c, const uint8_t *p, size_t len) {
+  for (size_t i = 0; i + 6 <= len; i += 6) {
+    uint16_t id = (uint16_t)(p[i] << 8 | p[i + 1]);
+    uint32_t v = get_u32(p + i + 2);
+
+    switch (id) {
+    case SETTINGS_HEADER_TABLE_SIZE:
+      hpack_table_limit(&c->encoder, v);
+      break;
+    case SETTINGS_ENABLE_PUSH:
+      if (v > 1)
+        return H2_PROTOCOL_ERROR;
+      break;
+    case SETTINGS_INITIAL_WINDOW_SIZE:
+      if (v > WINDOW_MAX)
+        return H2_FLOW_CONTROL_ERROR;
+      // The delta applies to open streams and must not overflow any
+      for (size_t s = 0; s < H2_MAX_STREAMS; s++) {
+        if (c->streams[s].id &&
+            c->streams[s].window + ((int64_t)v - c->initial_window) >
+                WINDOW_MAX)
+          return H2_FLOW_CONTROL_ERROR;
+      }
+      for (size_t s = 0; s < H2_MAX_STREAMS; s++) {
+        if (c->streams[s].id)
+          c->streams[s].window += (int64_t)v - c->initial_window;
+      }
+      c->initial_window = v;
+      break;
+    case SETTINGS_MAX_FRAME_SIZE:
+      if (v < DEFAULT_FRAME_SIZE || v > 0xffffff)
+        return H2_PROTOCOL_ERROR;
+      c->max_frame = v;
+      break;
+    }
+  }
+  return H2_NO_ERROR;
+}
+
+static void on_settings(h2_conn_t *c, uint8_t flags, uint32_t stream,
+                        const uint8_t *p, size_t len) {
+  if (stream != 0) {
+    conn_error(c, H2_PROTOCOL_ERROR);
+    return;
+  }
+  if (flags & FLAG_ACK) {
+    if (len != 0)
+      conn_error(c, H2_FRAME_SIZE_ERROR);
+    return;
+  }
+  if (len % 6 != 0) {
+    conn_error(c, H2_FRAME_SIZE_ERROR);
+    return;
+  }
+
+  uint32_t err = apply_settings(c, p, len);
+  if (err != H2_NO_ERROR) {
+    conn_error(c, err);
+    return;
+  }
+  send_frame(c, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+}
+
+static void on_window_update(h2_conn_t *c, uint32_t stream, const uint8_t *p,
+                             size_t len) {
+  if (len != 4) {
+    conn_error(c, H2_FRAME_SIZE_ERROR);
+    return;
+  }
+  uint32_t inc = get_u32(p) & WINDOW_MAX;
+
+  if (stream == 0) {
+    if (inc == 0 || c->window + inc > WINDOW_MAX)
+      conn_error(c, inc ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR);
+    else
+      c->window += inc;
+    return;
+  }
+
+  // Updates may still arrive for streams we already finished
+  h2_stream_t *s = stream_find(c, stream);
+  if (!s)
+    return;
+  if (inc == 0 || s->window + inc > WINDOW_MAX) {
+    send_rst(c, stream, inc ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR);
+    stream_close(c, s, false);
+    return;
+  }
+  s->window += inc;
+}
+
+static void on_frame(h2_conn_t *c, uint8_t type, uint8_t flags,
+                     uint32_t stream, const uint8_t *p, size_t len) {
+  if (c->block_stream && type != FRAME_CONTINUATION) {
+    conn_error(c, H2_PROTOCOL_ERROR);
+    return;
+  }
+
+  switch (type) {
+  case FRAME_DATA:
+    if (stream == 0 || stream > c->last_stream) {
+      conn_error(c, H2_PROTOCOL_ERROR);
+      return;
+    }
+    // Request bodies are discarded; hand the credit straight back
+    if (len > 0) {
+      send_window_update(c, 0, len);
+      if (!(flags & FLAG_END_STREAM) && stream_find(c, stream))
+        send_window_update(c, stream, len);
+    }
+    break;
+  case FRAME_HEADERS:
+    on_headers(c, flags, stream, p, len);
+    break;
+  case FRAME_CONTINUATION:
+    on_continuation(c, flags, stream, p, len);
+    break;
+  case FRAME_PRIORITY:
+    // Advisory only; streams are served round-robin
+    if (stream == 0)
+      conn_error(c, H2_PROTOCOL_ERROR);
+    break;
+  case FRAME_RST_STREAM: {
+    if (stream == 0 || len != 4) {
+      conn_error(c, stream ? H2_FRAME_SIZE_ERROR : H2_PROTOCOL_ERROR);
+      return;
+    }
+    h2_stream_t *s = stream_find(c, stream);
+    if (s)
+      stream_close(c, s, false);
+    break;
+  }
+  case FRAME_SETTINGS:
+    on_settings(c, flags, stream, p, len);
+    break;
+  case FRAME_PING:
+    if (stream != 0 || len != 8) {
+      conn_error(c, stream ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR);
+      return;
+    }
+    if (!(flags & FLAG_ACK))
+      send_frame(c, FRAME_PING, FLAG_ACK, 0, p, len);
+    break;
+  case FRAME_GOAWAY:
+    c->goaway = true;
+    break;
+  case FRAME_WINDOW_UPDATE:
+    on_window_update(c, stream, p, len);
+    break;
+  case FRAME_PUSH_PROMISE:
+    conn_error(c, H2_PROTOCOL_ERROR);
+    break;
+  default:
+    break; // Unknown frame types must be ignored
+  }
+}
+
+static void process_input(h2_conn_t *c) {
+  size_t pos = 0;
+
+  if (!c->preface) {
+    if (c->in_len < PREFACE_LEN)
+      return;
+    if (memcmp(c->in, PREFACE, PREFACE_LEN) != 0) {
+      conn_error(c, H2_PROTOCOL_ERROR);
+      return;
+    }
+    c->preface = true;
+    pos = PREFACE_LEN;
+  }
+
+  while (!c->closed && c->in_len - pos >= FRAME_HEADER_LEN) {
+    const uint8_t *h = c->in + pos;
+    size_t len = (size_t)h[0] << 16 | (size_t)h[1] << 8 | h[2];
+    if (len > H2_FRAME_SIZE) {
+      conn_error(c, H2_FRAME_SIZE_ERROR);
+      return;
+    }
+    if (c->in_len - pos < FRAME_HEADER_LEN + len)
+      break;
+
+    on_frame(c, h[3], h[4], get_u32(h + 5) & WINDOW_MAX,
+             h + FRAME_HEADER_LEN, len);
+    pos += FRAME_HEADER_LEN + len;
+  }
+
+  memmove(c->in, c->in + pos, c->in_len - pos);
+  c->in_len -= pos;
+}
+
+static bool stream_sendable(const h2_conn_t *c, const h2_stream_t *s) {
+  return s->id && s->sent < s->body.length && s->window > 0 && c->window > 0;
+}
+
+// One DATA frame. Mapped bodies go out in the same sendmsg as the frame
+// header; file and large archive bodies are sendfile'd behind it.
+static void send_data(h2_conn_t *c, h2_stream_t *s) {
+  size_t len = s->body.length - s->sent;
+  if (len > c->max_frame)
+    len = c->max_frame;
+  if ((int64_t)len > s->window)
+    len = s->window;
+  if ((int64_t)len > c->window)
+    len = c->window;
+  bool last = s->sent + len == s->body.length;
+
+  uint8_t header[FRAME_HEADER_LEN];
+  put_frame_header(header, len, FRAME_DATA, last ? FLAG_END_STREAM : 0,
+                   s->id);
+
+  ssize_t sent;
+  if (s->body.data && (s->body.fd < 0 || s->body.length <= PACK_INLINE_MAX)) {
+    struct iovec iov[2] = {
+        {.iov_base = header, .iov_len = sizeof(header)},
+        {.iov_base = (void *)(s->body.data + s->sent), .iov_len = len},
+    };
+    sent = io_send_iov(c->fd, iov, 2, false) - (ssize_t)sizeof(header);
+  } else {
+    io_send_more(c->fd, header, sizeof(header));
+    sent = io_send_file(c->fd, s->body.fd, s->body.offset + s->sent, len);
+  }
+
+  // A short body after the frame header was announced breaks framing
+  if (sent != (ssize_t)len) {
+    c->closed = true;
+    return;
+  }
+
+  s->sent += len;
+  s->window -= len;
+  c->window -= len;
+  if (last) {
+    TRACE_PROBE3(send_done, c->fd, s->status, s->sent);
+    stream_close(c, s, true);
+  }
+}
+
+// Each stream with window left gets one frame per round, so large bodies
+// cannot starve the small responses multiplexed beside them.
+static bool send_round(h2_conn_t *c) {
+  bool any = false;
+  for (size_t i = 0; i < H2_MAX_STREAMS && !c->closed; i++) {
+    h2_stream_t *s = &c->streams[(c->cursor + i) % H2_MAX_STREAMS];
+    if (stream_sendable(c, s)) {
+      send_data(c, s);
+      any = true;
+    }
+  }
+  c->cursor = (c->cursor + 1) % H2_MAX_STREAMS;
+  return any;
+}
+
+static bool has_sendable(const h2_conn_t *c) {
+  if (c->window <= 0 || c->active == 0)
+    return false;
+  for (size_t i = 0; i < H2_MAX_STREAMS; i++) {
+    if (stream_sendable(c, &c->streams[i]))
+      return true;
+  }
+  return false;
+}
+
+static bool read_input(h2_conn_t *c) {
+  ssize_t n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+  if (n == 0)
+    return false;
+  if (n < 0)
+    return errno == EAGAIN || errno == EINTR;
+
+  c->in_len += n;
+  process_input(c);
+  return true;
+}
+
+static void conn_run(h2_conn_t *c) {
+  uint64_t last_input = time_ms();
+
+  while (!c->closed) {
+    if (c->goaway && c->active == 0)
+      break;
+    if (!c->goaway && http_draining())
+      send_goaway(c, H2_NO_ERROR);
+
+    bool sendable = has_sendable(c);
+    struct pollfd pfd = {.fd = c->fd, .events = POLLIN};
+    int ready = poll(&pfd, 1, sendable ? 0 : HTTP_DRAIN_POLL_MS);
+    if (ready < 0 && errno != EINTR)
+      break;
+
+    if (ready > 0) {
+      if (!read_input(c))
+        break;
+      last_input = time_ms();
+    } else if (!sendable && time_ms() - last_input >= KEEPALIVE_TIMEOUT_MS) {
+      // Idle, or a peer that stopped granting window
+      if (!c->goaway)
+        send_goaway(c, H2_NO_ERROR);
+      break;
+    }
+
+    if (sendable)
+      send_round(c);
+  }
+}
+
+static h2_conn_t *conn_new(int fd) {
+  h2_conn_t *c = calloc(1, sizeof(*c));
+  if (!c) {
+    log_error("Out of memory for HTTP/2 connection");
+    return NULL;
+  }
+
+  c->fd = fd;
+  c->window = DEFAULT_WINDOW;
+  c->initial_window = DEFAULT_WINDOW;
+  c->max_frame = DEFAULT_FRAME_SIZE;
+  hpack_table_init(&c->decoder);
+  hpack_table_init(&c->encoder);
+  return c;
+}
+
+static void conn_free(h2_conn_t *c) {
+  for (size_t i = 0; i < H2_MAX_STREAMS; i++) {
+    if (c->streams[i].id)
+      stream_close(c, &c->streams[i], false);
+  }
+  hpack_table_free(&c->decoder);
+  hpack_table_free(&c->encoder);
+  free(c);
+}
+
+static bool send_settings(h2_conn_t *c) {
+  uint8_t payload[6] = {0, SETTINGS_MAX_CONCURRENT_STREAMS};
+  put_u32(payload + 2, H2_MAX_STREAMS);
+  return send_frame(c, FRAME_SETTINGS, 0, 0, payload, sizeof(payload));
+}
+
+bool h2_detect(int fd) {
+  char buf[PREFACE_LEN];
+  ssize_t n = recv(fd, buf, sizeof(buf), MSG_PEEK | MSG_DONTWAIT);
+
+  // No HTTP/1.1 method we serve starts with "PRI"
+  return n >= 3 && memcmp(buf, PREFACE, n) == 0;
+}
+
+void h2_serve(int fd) {
+  h2_conn_t *c = conn_new(fd);
+  if (!c)
+    return;
+  if (send_settings(c))
+    conn_run(c);
+  conn_free(c);
+}
+
+static ssize_t base64url_decode(const char *in, uint8_t *out, size_t cap) {
+  uint32_t acc = 0;
+  int bits = 0;
+  size_t n = 0;
+
+  for (; *in && *in != '='; in++) {
+    char ch = *in;
+    uint32_t v;
+    if (ch >= 'A' && ch <= 'Z')
+      v = ch - 'A';
+    else if (ch >= 'a' && ch <= 'z')
+      v = ch - 'a' + 26;
+    else if (ch >= '0' && ch <= '9')
+      v = ch - '0' + 52;
+    else if (ch == '-')
+      v = 62;
+    else if (ch == '_')
+      v = 63;
+    else
+      return -1;
+
+    acc = acc << 6 | v;
+    bits += 6;
+    if (bits >= 8) {
+      if (n == cap)
+        return -1;
+      bits -= 8;
+      out[n++] = (uint8_t)(acc >> bits);
+      acc &= (1u << bits) - 1;
+    }
+  }
+  return n;
+}
+
+bool h2_upgrade(int fd, const http_request_t *req) {
+  uint8_t settings[sizeof(req->http2_settings)];
+  ssize_t len = base64url_decode(req->http2_settings, settings,
+                                 sizeof(settings));
+  if (len < 0 || len % 6 != 0)
+    return false;
+
+  h2_conn_t *c = conn_new(fd);
+  if (!c)
+    return false;
+  if (apply_settings(c, settings, len) != H2_NO_ERROR) {
+    conn_free(c);
+    return false;
+  }
+
+  static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\n"
+                                  "Connection: Upgrade\r\n"
+                                  "Upgrade: h2c\r\n"
+                                  "\r\n";
+  if (io_send_buffer(fd, switching, sizeof(switching) - 1) >= 0 &&
+      send_settings(c)) {
+    // The upgraded request is stream 1, already closed by the client
+    c->last_stream = 1;
+    stream_start(c, 1, req);
+    conn_run(c);
+  }
+
+  conn_free(c);
+  return true;
+}
@@ -0,0 +1,20 @@
+#ifndef H2_H
+#define H2_H
+
+#include "http.h"
+#include <stdbool.h>
+
+// HTTP/2 over cleartext TCP (h2c), entered by prior knowledge or by an
+// HTTP/1.1 "Upgrade: h2c" request. Both serve the connection until it is
+// finished; the caller closes the fd.
+
+// True if a new connection opens with the HTTP/2 client preface.
+bool h2_detect(int fd);
+
+void h2_serve(int fd);
+
+// Answer req with 101 Switching Protocols and serve it as stream 1.
+// Returns false, having sent nothing, if its HTTP2-Settings is invalid.
+bool h2_upgrade(int fd, const http_request_t *req);
+
+#endif
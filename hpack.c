@@ -0,0 +1,497 @@
+#include "hpack.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  const char *name;
+  const char *value;
+} hpack_static_t;
+
+// RFC 7541 Appendix A, index 1..61
+static const hpack_static_t static_table[] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+#define STATIC_COUNT (sizeof(static_table) / sizeof(static_table[0]))
+
+// RFC 7541 Appendix B: {code, bit length} per symbol, 256 is EOS
+static const struct {
+  uint32_t code;
+  uint8_t bits;
+} huffman_codes[257] = {
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28},
+    {0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+    {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+    {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+    {0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28},
+    {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+    {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28},
+    {0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+    {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+    {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11},
+    {0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11},
+    {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+    {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6},
+    {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6},
+    {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+    {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10},
+    {0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7},
+    {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+    {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7},
+    {0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7},
+    {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+    {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7},
+    {0xfc, 8}, {0x73, 7}, {0xfd, 8}, {0x1ffb, 13},
+    {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+    {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5},
+    {0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6},
+    {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+    {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5},
+    {0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5},
+    {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+    {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15},
+    {0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28},
+    {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+    {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23},
+    {0x3fffd6, 22}, {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23},
+    {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+    {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23},
+    {0xffffee, 24}, {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23},
+    {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+    {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24},
+    {0x3fffda, 22}, {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22},
+    {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+    {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24},
+    {0x1fffdf, 21}, {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23},
+    {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+    {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23},
+    {0xfffea, 20}, {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22},
+    {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+    {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19},
+    {0x3fffe7, 22}, {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25},
+    {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+    {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25},
+    {0x7fff2, 19}, {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27},
+    {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+    {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26},
+    {0xffffffd, 28}, {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27},
+    {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+    {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23},
+    {0x3fffea, 22}, {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25},
+    {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+    {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26},
+    {0x7ffffe7, 27}, {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27},
+    {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+    {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26},
+    {0x3fffffff, 30},
+};
+
+// Decoding walks a binary tree built once from the code table. Children
+// >= 0 are node indexes, < 0 are leaves holding -(symbol + 1).
+static int16_t huffman_tree[256][2];
+static pthread_once_t huffman_once = PTHREAD_ONCE_INIT;
+
+static void huffman_build(void) {
+  int nodes = 1;
+  memset(huffman_tree, 0, sizeof(huffman_tree));
+
+  for (int sym = 0; sym < 257; sym++) {
+    uint32_t code = huffman_codes[sym].code;
+    int bits = huffman_codes[sym].bits;
+    int node = 0;
+
+    for (int i = bits - 1; i > 0; i--) {
+      int bit = (code >> i) & 1;
+      if (huffman_tree[node][bit] == 0)
+        huffman_tree[node][bit] = (int16_t)nodes++;
+      node = huffman_tree[node][bit];
+    }
+    huffman_tree[node][code & 1] = (int16_t)-(sym + 1);
+  }
+}
+
+static bool huffman_decode(const uint8_t *in, size_t len, char *out,
+                           size_t cap, size_t *out_len) {
+  pthread_once(&huffman_once, huffman_build);
+
+  int node = 0;
+  int pad_bits = 0;
+  bool pad_ones = true;
+  size_t n = 0;
+
+  for (size_t i = 0; i < len; i++) {
+    for (int b = 7; b >= 0; b--) {
+      int bit = (in[i] >> b) & 1;
+      pad_bits++;
+      pad_ones = pad_ones && bit;
+
+      int next = huffman_tree[node][bit];
+      if (next >= 0) {
+        node = next;
+        continue;
+      }
+
+      int sym = -next - 1;
+      if (sym == 256 || n == cap)
+        return false; // EOS in the string, or too long
+      out[n++] = (char)sym;
+      node = 0;
+      pad_bits = 0;
+      pad_ones = true;
+    }
+  }
+
+  // Padding is the most significant bits of EOS, at most 7 of them
+  if (pad_bits > 7 || !pad_ones)
+    return false;
+  *out_len = n;
+  return true;
+}
+
+void hpack_table_init(hpack_table_t *t) {
+  memset(t, 0, sizeof(*t));
+  t->max_size = HPACK_TABLE_SIZE;
+}
+
+static void evict_oldest(hpack_table_t *t) {
+  size_t slot = t->first;
+  t->size -= t->name_len[slot] + t->value_len[slot] + 32;
+  free(t->entries[slot]);
+  t->entries[slot] = NULL;
+  t->first = (slot + 1) % HPACK_MAX_ENTRIES;
+  t->count--;
+}
+
+void hpack_table_free(hpack_table_t *t) {
+  while (t->count > 0)
+    evict_oldest(t);
+}
+
+static void table_resize(hpack_table_t *t, size_t max) {
+  t->max_size = max;
+  while (t->size > max)
+    evict_oldest(t);
+}
+
+void hpack_table_limit(hpack_table_t *t, size_t max) {
+  if (max > HPACK_TABLE_SIZE)
+    max = HPACK_TABLE_SIZE;
+  if (max != t->max_size) {
+    table_resize(t, max);
+    t->size_changed = true;
+  }
+}
+
+static bool table_add(hpack_table_t *t, const char *name, size_t name_len,
+                      const char *value, size_t value_len) {
+  size_t need = name_len + value_len + 32;
+
+  // An entry larger than the table empties it and is not stored
+  if (need > t->max_size) {
+    hpack_table_free(t);
+    return true;
+  }
+  while (t->size + need > t->max_size)
+    evict_oldest(t);
+
+  // Both sides must agree on the table, so failing here is fatal
+  char *entry = malloc(name_len + value_len + 1);
+  if (!entry)
+    return false;
+  memcpy(entry, name, name_len);
+  memcpy(entry + name_len, value, value_len);
+
+  size_t slot = (t->first + t->count) % HPACK_MAX_ENTRIES;
+  t->entries[slot] = entry;
+  t->name_len[slot] = (uint32_t)name_len;
+  t->value_len[slot] = (uint32_t)value_len;
+  t->count++;
+  t->size += need;
+  return true;
+}
+
+// index is 1-based over the static table followed by the dynamic table,
+// newest entry first.
+static bool table_get(const hpack_table_t *t, uint32_t index,
+                      const char **name, size_t *name_len, const char **value,
+                      size_t *value_len) {
+  if (index == 0)
+    return false;
+
+  if (index <= STATIC_COUNT) {
+    const hpack_static_t *s = &static_table[index - 1];
+    *name = s->name;
+    *name_len = strlen(s->name);
+    *value = s->value;
+    *value_len = strlen(s->value);
+    return true;
+  }
+
+  size_t i = index - STATIC_COUNT - 1;
+  if (i >= t->count)
+    return false;
+
+  size_t slot = (t->first + t->count - 1 - i) % HPACK_MAX_ENTRIES;
+  *name = t->entries[slot];
+  *name_len = t->name_len[slot];
+  *value = t->entries[slot] + t->name_len[slot];
+  *value_len = t->value_len[slot];
+  return true;
+}
+
+static bool decode_int(const uint8_t **p, const uint8_t *end, int prefix,
+                       uint32_t *out) {
+  if (*p >= end)
+    return false;
+
+  uint32_t max = (1u << prefix) - 1;
+  uint32_t v = *(*p)++ & max;
+  if (v < max) {
+    *out = v;
+    return true;
+  }
+
+  for (int shift = 0; *p < end && shift <= 21; shift += 7) {
+    uint8_t b = *(*p)++;
+    v += (uint32_t)(b & 0x7f) << shift;
+    if (!(b & 0x80)) {
+      *out = v;
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool decode_string(const uint8_t **p, const uint8_t *end, char *out,
+                          size_t *out_len) {
+  if (*p >= end)
+    return false;
+
+  bool huffman = **p & 0x80;
+  uint32_t len;
+  if (!decode_int(p, end, 7, &len) || len > (size_t)(end - *p))
+    return false;
+
+  const uint8_t *src = *p;
+  *p += len;
+
+  if (huffman)
+    return huffman_decode(src, len, out, HPACK_MAX_STRING, out_len);
+  if (len > HPACK_MAX_STRING)
+    return false;
+  memcpy(out, src, len);
+  *out_len = len;
+  return true;
+}
+
+int hpack_decode(hpack_table_t *t, const uint8_t *in, size_t len,
+                 hpack_header_fn fn, void *ctx) {
+  static _Thread_local char name_buf[HPACK_MAX_STRING];
+  static _Thread_local char value_buf[HPACK_MAX_STRING];
+  const uint8_t *p = in;
+  const uint8_t *end = in + len;
+
+  while (p < end) {
+    uint8_t b = *p;
+    uint32_t index;
+    const char *name, *value;
+    size_t name_len, value_len;
+
+    if (b & 0x80) {
+      // Indexed header field
+      if (!decode_int(&p, end, 7, &index) ||
+          !table_get(t, index, &name, &name_len, &value, &value_len))
+        return -1;
+      fn(ctx, name, name_len, value, value_len);
+      continue;
+    }
+
+    if ((b & 0xe0) == 0x20) {
+      // Dynamic table size update
+      if (!decode_int(&p, end, 5, &index) || index > HPACK_TABLE_SIZE)
+        return -1;
+      table_resize(t, index);
+      continue;
+    }
+
+    // Literal: with incremental indexing (01), without (0000) or never
+    // indexed (0001). The name is an index or a string.
+    bool add = (b & 0xc0) == 0x40;
+    if (!decode_int(&p, end, add ? 6 : 4, &index))
+      return -1;
+
+    if (index) {
+      const char *ignored;
+      size_t ignored_len;
+      if (!table_get(t, index, &name, &name_len, &ignored, &ignored_len))
+        return -1;
+      // The name may live in an entry the insertion below evicts
+      memcpy(name_buf, name, name_len);
+    } else if (!decode_string(&p, end, name_buf, &name_len)) {
+      return -1;
+    }
+
+    if (!decode_string(&p, end, value_buf, &value_len))
+      return -1;
+
+    if (add && !table_add(t, name_buf, name_len, value_buf, value_len))
+      return -1;
+    fn(ctx, name_buf, name_len, value_buf, value_len);
+  }
+
+  return 0;
+}
+
+static size_t encode_int(uint8_t *out, size_t cap, uint8_t first, int prefix,
+                         uint32_t v) {
+  uint32_t max = (1u << prefix) - 1;
+  if (cap == 0)
+    return 0;
+  if (v < max) {
+    out[0] = first | (uint8_t)v;
+    return 1;
+  }
+
+  out[0] = first | (uint8_t)max;
+  v -= max;
+  size_t n = 1;
+  while (v >= 0x80) {
+    if (n >= cap)
+      return 0;
+    out[n++] = (uint8_t)(v | 0x80);
+    v >>= 7;
+  }
+  if (n >= cap)
+    return 0;
+  out[n++] = (uint8_t)v;
+  return n;
+}
+
+// Literal strings go out raw; our values are short and mostly digits,
+// which Huffman barely shrinks.
+static size_t encode_string(uint8_t *out, size_t cap, const char *s,
+                            size_t len) {
+  size_t n = encode_int(out, cap, 0x00, 7, (uint32_t)len);
+  if (n == 0 || cap - n < len)
+    return 0;
+  memcpy(out + n, s, len);
+  return n + len;
+}
+
+size_t hpack_encode_begin(hpack_table_t *t, uint8_t *out, size_t cap) {
+  if (!t->size_changed)
+    return 0;
+  t->size_changed = false;
+  return encode_int(out, cap, 0x20, 5, (uint32_t)t->max_size);
+}
+
+size_t hpack_encode(hpack_table_t *t, uint8_t *out, size_t cap,
+                    const char *name, const char *value, size_t value_len,
+                    bool index) {
+  size_t name_len = strlen(name);
+  uint32_t name_index = 0;
+
+  for (size_t i = 0; i < STATIC_COUNT; i++) {
+    if (strcmp(static_table[i].name, name) != 0)
+      continue;
+    if (!name_index)
+      name_index = (uint32_t)i + 1;
+    if (strlen(static_table[i].value) == value_len &&
+        memcmp(static_table[i].value, value, value_len) == 0)
+      return encode_int(out, cap, 0x80, 7, (uint32_t)i + 1);
+  }
+
+  for (size_t i = 0; i < t->count; i++) {
+    size_t slot = (t->first + t->count - 1 - i) % HPACK_MAX_ENTRIES;
+    const char *entry = t->entries[slot];
+    if (t->name_len[slot] != name_len || memcmp(entry, name, name_len) != 0)
+      continue;
+    uint32_t dyn_index = (uint32_t)(STATIC_COUNT + 1 + i);
+    if (!name_index)
+      name_index = dyn_index;
+    if (t->value_len[slot] == value_len &&
+        memcmp(entry + name_len, value, value_len) == 0)
+      return encode_int(out, cap, 0x80, 7, dyn_index);
+  }
+
+  size_t n = index ? encode_int(out, cap, 0x40, 6, name_index)
+                   : encode_int(out, cap, 0x00, 4, name_index);
+  if (n == 0)
+    return 0;
+
+  if (!name_index) {
+    size_t m = encode_string(out + n, cap - n, name, name_len);
+    if (m == 0)
+      return 0;
+    n += m;
+  }
+
+  size_t m = encode_string(out + n, cap - n, value, value_len);
+  if (m == 0)
+    return 0;
+
+  if (index && !table_add(t, name, name_len, value, value_len))
+    return 0;
+  return n + m;
+}
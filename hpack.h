@@ -0,0 +1,48 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// RFC 7541 header compression. One table per direction per connection.
+
+#define HPACK_TABLE_SIZE 4096 // SETTINGS_HEADER_TABLE_SIZE default
+#define HPACK_MAX_ENTRIES (HPACK_TABLE_SIZE / 32)
+#define HPACK_MAX_STRING 8192 // Longest decoded name or value
+
+typedef struct {
+  char *entries[HPACK_MAX_ENTRIES]; // Name immediately followed by value
+  uint32_t name_len[HPACK_MAX_ENTRIES];
+  uint32_t value_len[HPACK_MAX_ENTRIES];
+  size_t first; // Ring slot of the oldest entry
+  size_t count;
+  size_t size;       // RFC size: name + value + 32 per entry
+  size_t max_size;   // Never above HPACK_TABLE_SIZE
+  bool size_changed; // Encoder: announce max_size in the next block
+} hpack_table_t;
+
+typedef void (*hpack_header_fn)(void *ctx, const char *name, size_t name_len,
+                                const char *value, size_t value_len);
+
+void hpack_table_init(hpack_table_t *t);
+void hpack_table_free(hpack_table_t *t);
+
+// Encoder side: follow the peer's SETTINGS_HEADER_TABLE_SIZE.
+void hpack_table_limit(hpack_table_t *t, size_t max);
+
+// Decode a complete header block, calling fn once per header in order.
+// Returns -1 on a compression error, after which the connection is dead.
+int hpack_decode(hpack_table_t *t, const uint8_t *in, size_t len,
+                 hpack_header_fn fn, void *ctx);
+
+// Append one header to out. Exact static/dynamic matches become a single
+// index byte; otherwise a literal, added to the dynamic table if index is
+// set. Call hpack_encode_begin first in every block. Both return the
+// bytes written, or 0 if cap is too small.
+size_t hpack_encode_begin(hpack_table_t *t, uint8_t *out, size_t cap);
+size_t hpack_encode(hpack_table_t *t, uint8_t *out, size_t cap,
+                    const char *name, const char *value, size_t value_len,
+                    bool index);
+
+#endif
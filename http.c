@@ -1,46 +1,66 @@
 #include "http.h"
 #include "config.h"
+#include "h2.h"
 #include "io.h"
+#include "pack.h"
+#include "path.h"
+#include "proxy.h"
+#include "response.h"
+#include "trace.h"
 #include "utils.h"
 #include <errno.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
-static const char *get_mime_type(const char *path) {
-  const char *ext = strrchr(path, '.');
-  if (!ext)
-    return "application/octet-stream";
-
-  if (strcmp(ext, ".html") == 0 || strcmp(ext, ".htm") == 0)
-    return "text/html";
-  if (strcmp(ext, ".css") == 0)
-    return "text/css";
-  if (strcmp(ext, ".js") == 0)
-    return "application/javascript";
-  if (strcmp(ext, ".png") == 0)
-    return "image/png";
-  if (strcmp(ext, ".jpg") == 0 || strcmp(ext, ".jpeg") == 0)
-    return "image/jpeg";
-  if (strcmp(ext, ".gif") == 0)
-    return "image/gif";
-  if (strcmp(ext, ".txt") == 0)
-    return "text/plain";
-
-  return "application/octet-stream";
+static _Atomic bool draining;
+
+void http_begin_drain(void) {
+  atomic_store_explicit(&draining, true, memory_order_release);
+}
+
+bool http_draining(void) {
+  return atomic_load_explicit(&draining, memory_order_acquire);
+}
+
+// poll() in short slices so a drain can interrupt idle keep-alive waits.
+static int wait_readable(int fd, int timeout_ms, bool interruptible) {
+  while (1) {
+    if (interruptible && http_draining())
+      return 0;
+
+    int slice = HTTP_DRAIN_POLL_MS;
+    if (timeout_ms >= 0 && timeout_ms < slice)
+      slice = timeout_ms;
+
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    int ready = poll(&pfd, 1, slice);
+    if (ready != 0)
+      return ready;
+
+    if (timeout_ms >= 0) {
+      timeout_ms -= slice;
+      if (timeout_ms <= 0)
+        return 0;
+    }
+  }
 }
 
-int http_handle_job(job_t *job) {
+int http_handle_job(job_t *job, http_transfer_t *bulk) {
   http_request_t req;
-  int req_count = 0;
+  int req_count = job->requests;
 
   while (req_count < KEEPALIVE_MAX_REQ) {
-    struct pollfd pfd = {.fd = job->client_fd, .events = POLLIN};
-    int ready = poll(&pfd, 1, job->keep_alive ? job->timeout_ms : -1);
+    // A freshly accepted connection still gets its first request served
+    // during a drain; only idle keep-alive waits are cut short.
+    int ready = wait_readable(job->client_fd,
+                              job->keep_alive ? job->timeout_ms : -1,
+                              req_count > 0);
 
     if (ready < 0) {
       if (errno == EINTR)
@@ -52,67 +72,155 @@ int http_handle_job(job_t *job) {
       break;
     }
 
-    if (http_parse_request(job->client_fd, &req) < 0) {
+    // Prior-knowledge HTTP/2 can only start a connection
+    if (req_count == 0 && h2_detect(job->client_fd)) {
+      h2_serve(job->client_fd);
+      break;
+    }
+
+    trace_req_begin();
+    int parsed = http_parse_request(job->client_fd, &req);
+    if (parsed < 0)
+      break;
+    if (parsed > 0) {
+      http_send_response(job->client_fd, &req, parsed,
+                         response_reason(parsed));
       break;
     }
+    trace_stage(TRACE_PARSED);
+    TRACE_PROBE2(parse_done, job->client_fd, req.path);
 
     req_count++;
+    if (http_draining())
+      req.keep_alive = false;
+
+    if (req.upgrade_h2c && req.http2_settings[0] && !http_draining() &&
+        req.content_length == 0 && h2_upgrade(job->client_fd, &req)) {
+      trace_req_end(req.method, req.path, 101);
+      break;
+    }
 
-    // uint64_t start_time = time_ms();
     int status_code = 200;
+    char safe_path[PATH_MAX_LEN];
+    bool resolved = path_normalize(req.path, safe_path, sizeof(safe_path));
+    trace_stage(TRACE_RESOLVED);
+    proxy_route_t *route = resolved ? proxy_match(safe_path) : NULL;
 
-    if (strcmp(req.method, "GET") != 0 && strcmp(req.method, "HEAD") != 0) {
+    if (route) {
+      status_code = proxy_forward(job->client_fd, &req, route);
+    } else if (strcmp(req.method, "GET") != 0 &&
+               strcmp(req.method, "HEAD") != 0) {
       status_code = 405;
       http_send_response(job->client_fd, &req, status_code,
                          "Method Not Allowed");
+    } else if (!resolved) {
+      status_code = 403;
+      http_send_response(job->client_fd, &req, status_code, "Forbidden");
     } else {
-      char safe_path[PATH_MAX_LEN];
-      if (!path_safe(".", req.path, safe_path, sizeof(safe_path))) {
-        status_code = 403;
-        http_send_response(job->client_fd, &req, status_code, "Forbidden");
-      } else {
-        int result = http_serve_file(job->client_fd, safe_path, req.keep_alive);
-        if (result < 0) {
-          status_code = 404;
-        }
+      int result =
+          pack_enabled()
+              ? http_serve_packed(job->client_fd, &req, safe_path, bulk)
+              : http_serve_file(job->client_fd, safe_path, req.keep_alive,
+                                bulk);
+      if (result < 0) {
+        status_code = 404;
+      } else if (result == HTTP_JOB_BULK) {
+        trace_req_detach(&bulk->trace, req.method, req.path);
+        job->requests = req_count;
+        return HTTP_JOB_BULK;
       }
     }
 
-    // uint64_t response_time = time_ms() - start_time;
-    // log_info("%s %s %d %lums", req.method, req.path, status_code,
-    //          response_time);
+    trace_req_end(req.method, req.path, status_code);
 
     if (!req.keep_alive)
       break;
   }
 
   close(job->client_fd);
+  return HTTP_JOB_DONE;
+}
+
+// Reads until the blank line that ends the head, so forwarding never
+// sees a partial one. The whole head shares one HTTP_HEAD_TIMEOUT_MS
+// budget from its first bytes, so trickling bytes cannot hold a worker.
+static int read_head(int fd, http_request_t *req) {
+  size_t n = 0;
+  uint64_t deadline = 0;
+  while (1) {
+    ssize_t got = read(fd, req->raw + n, sizeof(req->raw) - 1 - n);
+    if (got > 0) {
+      if (n == 0)
+        deadline = time_ms() + HTTP_HEAD_TIMEOUT_MS;
+      size_t from = n > 3 ? n - 3 : 0;
+      n += got;
+      if (memmem(req->raw + from, n - from, "\r\n\r\n", 4))
+        break;
+      if (n == sizeof(req->raw) - 1)
+        return 431;
+      continue;
+    }
+    if (got == 0)
+      return -1;
+    if (errno == EINTR)
+      continue;
+    if (errno != EAGAIN)
+      return -1;
+
+    int left = HTTP_HEAD_TIMEOUT_MS;
+    if (n > 0) {
+      uint64_t now = time_ms();
+      if (now >= deadline)
+        return 408;
+      left = (int)(deadline - now);
+    }
+    int ready = wait_readable(fd, left, false);
+    if (ready < 0 && errno == EINTR)
+      continue;
+    if (ready <= 0)
+      return ready == 0 && n > 0 ? 408 : -1;
+  }
+
+  req->raw[n] = '\0';
+  req->raw_len = n;
+  req->header_len = n;
   return 0;
 }
 
 int http_parse_request(int fd, http_request_t *req) {
-  char buf[BUFFER_SIZE];
-  ssize_t n = read(fd, buf, sizeof(buf) - 1);
-  if (n <= 0)
-    return -1;
-  buf[n] = '\0';
+  req->keep_alive = false;
+  int rc = read_head(fd, req);
+  if (rc != 0)
+    return rc;
 
-  char *line = buf;
+  // Lines are NUL-terminated while parsed and restored afterwards, so raw
+  // stays intact for forwarding.
+  char *line = req->raw;
   char *end = strstr(line, "\r\n");
   if (!end)
     return -1;
   *end = '\0';
 
-  if (sscanf(line, "%7s %255s %15s", req->method, req->path, req->version) !=
-      3) {
+  int fields =
+      sscanf(line, "%7s %255s %15s", req->method, req->path, req->version);
+  *end = '\r';
+  if (fields != 3)
     return -1;
-  }
 
   req->keep_alive = (strcmp(req->version, "HTTP/1.1") == 0);
   req->content_length = 0;
+  req->accept_gzip = false;
+  req->if_none_match[0] = '\0';
+  req->upgrade_h2c = false;
+  req->http2_settings[0] = '\0';
+  req->chunked = false;
 
   line = end + 2;
-  while ((end = strstr(line, "\r\n")) != NULL && line != end) {
+  while ((end = strstr(line, "\r\n")) != NULL) {
+    if (line == end) {
+      req->header_len = end + 2 - req->raw;
+      break;
+    }
     *end = '\0';
 
     if (strncasecmp(line, "Connection:", 11) == 0) {
@@ -125,8 +233,25 @@ int http_parse_request(int fd, http_request_t *req) {
         req->keep_alive = true;
     } else if (strncasecmp(line, "Content-Length:", 15) == 0) {
       req->content_length = atoi(line + 15);
+    } else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+      req->chunked = true;
+    } else if (strncasecmp(line, "Accept-Encoding:", 16) == 0) {
+      req->accept_gzip = strstr(line + 16, "gzip") != NULL;
+    } else if (strncasecmp(line, "If-None-Match:", 14) == 0) {
+      char *val = line + 14;
+      while (*val == ' ')
+        val++;
+      snprintf(req->if_none_match, sizeof(req->if_none_match), "%s", val);
+    } else if (strncasecmp(line, "Upgrade:", 8) == 0) {
+      req->upgrade_h2c = strcasestr(line + 8, "h2c") != NULL;
+    } else if (strncasecmp(line, "HTTP2-Settings:", 15) == 0) {
+      char *val = line + 15;
+      while (*val == ' ')
+        val++;
+      snprintf(req->http2_settings, sizeof(req->http2_settings), "%s", val);
     }
 
+    *end = '\r';
     line = end + 2;
   }
 
@@ -135,57 +260,183 @@ int http_parse_request(int fd, http_request_t *req) {
 
 int http_send_response(int fd, http_request_t *req, int status,
                        const char *msg) {
-  char buf[BUFFER_SIZE];
-  int n = snprintf(buf, sizeof(buf),
-                   "HTTP/1.1 %d %s\r\n"
-                   "Content-Type: text/plain\r\n"
-                   "Content-Length: %zu\r\n"
-                   "Connection: %s\r\n"
-                   "\r\n"
-                   "%s",
-                   status, msg, strlen(msg),
-                   req->keep_alive ? "keep-alive" : "close", msg);
-
-  return io_send_buffer(fd, buf, n);
-}
+  static const char text_plain[] = "Content-Type: text/plain\r\n";
+  size_t len = strlen(msg);
 
-int http_serve_file(int fd, const char *path, bool keep_alive) {
+  response_t r;
+  response_begin(&r, status);
+  response_add(&r, text_plain, sizeof(text_plain) - 1);
+  response_content_length(&r, len);
+  response_end(&r, req->keep_alive);
+  response_add(&r, msg, len);
 
-  int file_fd = open(path, O_RDONLY);
-  if (file_fd < 0) {
-    http_request_t dummy = {.keep_alive = keep_alive};
-    http_send_response(fd, &dummy, 404, "Not Found");
-    return -1;
-  }
+  trace_stage(TRACE_SEND_START);
+  TRACE_PROBE2(send_start, fd, len);
+  ssize_t sent = response_send(fd, &r, false);
+  trace_stage(TRACE_SEND_DONE);
+  TRACE_PROBE3(send_done, fd, status, sent);
+  return sent;
+}
+
+static int resolve_file(const char *path, http_body_t *body) {
+  int file_fd = path_open(path, O_RDONLY);
+  if (file_fd < 0)
+    return errno == EXDEV ? 403 : 404;
 
   struct stat st;
   if (fstat(file_fd, &st) < 0) {
     close(file_fd);
-    http_request_t dummy = {.keep_alive = keep_alive};
-    http_send_response(fd, &dummy, 500, "Internal Server Error");
-    return -1;
+    return 500;
   }
 
   if (S_ISDIR(st.st_mode)) {
     close(file_fd);
     char index_path[PATH_MAX_LEN];
     snprintf(index_path, sizeof(index_path), "%s/index.html", path);
-    return http_serve_file(fd, index_path, keep_alive);
+    return resolve_file(index_path, body);
+  }
+
+  const response_mime_t *mime = response_mime(path);
+  *body = (http_body_t){.fd = file_fd,
+                        .owns_fd = true,
+                        .length = st.st_size,
+                        .mime = mime->type,
+                        .mime_len = mime->type_len,
+                        .content_type = mime->header,
+                        .content_type_len = mime->header_len};
+  return 200;
+}
+
+static int resolve_packed(const char *path, bool accept_gzip,
+                          http_body_t *body) {
+  const pack_entry_t *e = pack_lookup(path);
+  if (!e)
+    return 404;
+
+  int v = PACK_IDENTITY;
+  if (accept_gzip && e->body[PACK_GZIP].len > 0)
+    v = PACK_GZIP;
+
+  *body = (http_body_t){.fd = pack_fd(),
+                        .data = pack_data(e->body[v]),
+                        .offset = e->body[v].off,
+                        .length = e->body[v].len,
+                        .mime = pack_data(e->mime),
+                        .mime_len = e->mime.len,
+                        .etag = pack_data(e->etag[v]),
+                        .etag_len = e->etag[v].len,
+                        .gzip = v == PACK_GZIP,
+                        .vary = e->body[PACK_GZIP].len > 0};
+  return 200;
+}
+
+int http_resolve(const char *path, bool accept_gzip, http_body_t *body) {
+  return pack_enabled() ? resolve_packed(path, accept_gzip, body)
+                        : resolve_file(path, body);
+}
+
+int http_serve_file(int fd, const char *path, bool keep_alive,
+                    http_transfer_t *bulk) {
+  http_body_t body;
+  int status = resolve_file(path, &body);
+  if (status != 200) {
+    http_request_t dummy = {.keep_alive = keep_alive};
+    http_send_response(fd, &dummy, status, response_reason(status));
+    return -1;
   }
+  trace_stage(TRACE_OPENED);
+
+  response_t r;
+  response_begin(&r, 200);
+  response_add(&r, body.content_type, body.content_type_len);
+  response_content_length(&r, body.length);
+  response_end(&r, keep_alive);
 
-  char header[BUFFER_SIZE];
-  int header_len = snprintf(header, sizeof(header),
-                            "HTTP/1.1 200 OK\r\n"
-                            "Content-Type: %s\r\n"
-                            "Content-Length: %ld\r\n"
-                            "Connection: %s\r\n"
-                            "\r\n",
-                            get_mime_type(path), st.st_size,
-                            keep_alive ? "keep-alive" : "close");
+  trace_stage(TRACE_SEND_START);
+  TRACE_PROBE2(send_start, fd, body.length);
+  response_send(fd, &r, true);
 
-  io_send_buffer(fd, header, header_len);
-  io_send_file(fd, file_fd, 0, st.st_size);
+  if (bulk && body.length >= LANE_BULK_MIN) {
+    *bulk = (http_transfer_t){.file_fd = body.fd,
+                              .owns_fd = true,
+                              .offset = 0,
+                              .remaining = body.length,
+                              .keep_alive = keep_alive,
+                              .status = 200};
+    return HTTP_JOB_BULK;
+  }
+
+  ssize_t sent = io_send_file(fd, body.fd, 0, body.length);
+  trace_stage(TRACE_SEND_DONE);
+  TRACE_PROBE3(send_done, fd, 200, sent);
+
+  close(body.fd);
+  return 0;
+}
+
+int http_serve_packed(int fd, http_request_t *req, const char *path,
+                      http_transfer_t *bulk) {
+  const pack_entry_t *e = pack_lookup(path);
+  if (!e) {
+    http_send_response(fd, req, 404, "Not Found");
+    return -1;
+  }
+  trace_stage(TRACE_OPENED);
+
+  int v = PACK_IDENTITY;
+  if (req->accept_gzip && e->body[PACK_GZIP].len > 0)
+    v = PACK_GZIP;
+
+  pack_span_t etag = e->etag[v];
+  response_t r;
+
+  if (req->if_none_match[0] && strlen(req->if_none_match) == etag.len &&
+      memcmp(req->if_none_match, pack_data(etag), etag.len) == 0) {
+    response_begin(&r, 304);
+    response_add(&r, "ETag: ", 6);
+    response_add(&r, pack_data(etag), etag.len);
+    response_add(&r, "\r\n", 2);
+    response_end(&r, req->keep_alive);
+    trace_stage(TRACE_SEND_START);
+    TRACE_PROBE2(send_start, fd, 0);
+    response_send(fd, &r, false);
+    trace_stage(TRACE_SEND_DONE);
+    TRACE_PROBE3(send_done, fd, 304, 0);
+    return 0;
+  }
+
+  pack_span_t body = e->body[v];
+  bool send_body = strcmp(req->method, "HEAD") != 0;
+
+  response_begin(&r, 200);
+  response_add(&r, pack_data(e->headers[v]), e->headers[v].len);
+  response_end(&r, req->keep_alive);
+
+  // Small bodies go out in the same writev straight from the mapping;
+  // large ones are sent from the archive fd so the kernel avoids a copy.
+  trace_stage(TRACE_SEND_START);
+  TRACE_PROBE2(send_start, fd, send_body ? body.len : 0);
+  ssize_t sent = 0;
+  if (send_body && body.len <= PACK_INLINE_MAX) {
+    response_add(&r, pack_data(body), body.len);
+    sent = response_send(fd, &r, false);
+  } else if (send_body) {
+    response_send(fd, &r, true);
+    if (bulk && body.len >= LANE_BULK_MIN) {
+      *bulk = (http_transfer_t){.file_fd = pack_fd(),
+                                .owns_fd = false,
+                                .offset = body.off,
+                                .remaining = body.len,
+                                .keep_alive = req->keep_alive,
+                                .status = 200};
+      return HTTP_JOB_BULK;
+    }
+    sent = io_send_file(fd, pack_fd(), body.off, body.len);
+  } else {
+    sent = response_send(fd, &r, false);
+  }
+  trace_stage(TRACE_SEND_DONE);
+  TRACE_PROBE3(send_done, fd, 200, sent);
 
-  close(file_fd);
   return 0;
 }
@@ -1,7 +1,10 @@
 #ifndef HTTP_H
 #define HTTP_H
 
+#include "config.h"
 #include "queue.h"
+#include "trace.h"
+#include <sys/types.h>
 
 typedef struct {
   char method[8];
@@ -9,12 +12,69 @@ typedef struct {
   char version[16];
   bool keep_alive;
   int content_length;
+  bool accept_gzip;
+  char if_none_match[72];
+  bool upgrade_h2c;
+  char http2_settings[128]; // base64url SETTINGS payload for the upgrade
+  bool chunked;             // Transfer-Encoding present
+  char raw[BUFFER_SIZE];    // Bytes read for this request, as received
+  size_t raw_len;
+  size_t header_len; // Request line and headers up to the blank line
 } http_request_t;
 
-int http_handle_job(job_t *job);
+// Body still to be sent after the headers went out. Produced instead of
+// sending when a response is at least LANE_BULK_MIN bytes, so the caller
+// can move the connection to the bulk lane.
+typedef struct {
+  int file_fd;
+  bool owns_fd; // Close file_fd when done (false for the archive fd)
+  off_t offset;
+  size_t remaining;
+  bool keep_alive;
+  int status;        // Of the response whose body this is
+  trace_req_t trace; // Finished by the bulk lane
+} http_transfer_t;
+
+// A response body located but not yet sent, so HTTP/1.1 and HTTP/2 can
+// frame it their own way.
+typedef struct {
+  int fd;           // File or archive fd, -1 if data holds the whole body
+  bool owns_fd;     // Close fd when done (false for the archive fd)
+  const char *data; // Body bytes when mapped (archive) or static, else NULL
+  off_t offset;
+  size_t length;
+  const char *mime; // Not NUL-terminated for archive entries
+  size_t mime_len;
+  const char *content_type; // Pre-rendered header line, files only
+  size_t content_type_len;
+  const char *etag; // Archive entries only, else NULL
+  size_t etag_len;
+  bool gzip;
+  bool vary; // A gzip variant exists
+} http_body_t;
+
+#define HTTP_JOB_DONE 0 // Connection finished and closed
+#define HTTP_JOB_BULK 1 // Connection handed off with *bulk filled in
+
+// bulk may be NULL to always send inline.
+int http_handle_job(job_t *job, http_transfer_t *bulk);
+// 0 when req holds a full head, -1 to drop the connection, or an error
+// status (408, 431) to send before closing.
 int http_parse_request(int fd, http_request_t *req);
 int http_send_response(int fd, http_request_t *req, int status,
                        const char *msg);
-int http_serve_file(int fd, const char *path, bool keep_alive);
+int http_serve_file(int fd, const char *path, bool keep_alive,
+                    http_transfer_t *bulk);
+int http_serve_packed(int fd, http_request_t *req, const char *path,
+                      http_transfer_t *bulk);
+
+// Locate the body for a path_normalize()d path, from the archive when one
+// is loaded. Returns 200, or the error status to send instead.
+int http_resolve(const char *path, bool accept_gzip, http_body_t *body);
+
+// Finish in-flight requests with "Connection: close" and drop idle
+// keep-alive connections.
+void http_begin_drain(void);
+bool http_draining(void);
 
 #endif
@@ -1,14 +1,39 @@
 #include "io.h"
+#include "config.h"
 #include <errno.h>
+#include <fcntl.h>
 #include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
+void io_advise(int in_fd, off_t offset, off_t end, off_t *advised) {
+  if (*advised < 0) {
+    posix_fadvise(in_fd, offset, end - offset, POSIX_FADV_SEQUENTIAL);
+    *advised = offset;
+  }
+  if (*advised < end && *advised - offset < IO_READAHEAD_WINDOW) {
+    off_t len = end - *advised < IO_READAHEAD_WINDOW ? end - *advised
+                                                     : IO_READAHEAD_WINDOW;
+    posix_fadvise(in_fd, *advised, len, POSIX_FADV_WILLNEED);
+    *advised += len;
+  }
+}
+
 ssize_t io_send_file(int out_fd, int in_fd, off_t offset, size_t count) {
   off_t off = offset;
   ssize_t total = 0;
 
+  bool advise = count >= IO_FADVISE_MIN;
+  off_t advised = -1;
+  off_t end = offset + (off_t)count;
+
   while (count > 0) {
+    if (advise)
+      io_advise(in_fd, off, end, &advised);
+
     ssize_t sent = sendfile(out_fd, in_fd, &off, count);
 
     if (sent < 0) {
@@ -32,12 +57,41 @@ ssize_t io_send_file(int out_fd, int in_fd, off_t offset, size_t count) {
   return total;
 }
 
-ssize_t io_send_buffer(int fd, const void *buf, size_t count) {
+ssize_t io_send_file_nowait(int out_fd, int in_fd, off_t offset, size_t count,
+                            bool *blocked) {
+  off_t off = offset;
+  ssize_t total = 0;
+  *blocked = false;
+
+  while (count > 0) {
+    ssize_t sent = sendfile(out_fd, in_fd, &off, count);
+
+    if (sent < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN) {
+        *blocked = true;
+        return total;
+      }
+      return total > 0 ? total : -1;
+    }
+
+    if (sent == 0)
+      break; // EOF
+
+    total += sent;
+    count -= sent;
+  }
+
+  return total;
+}
+
+static ssize_t send_all(int fd, const void *buf, size_t count, int flags) {
   const char *p = buf;
   ssize_t total = 0;
 
   while (count > 0) {
-    ssize_t n = write(fd, p, count);
+    ssize_t n = send(fd, p, count, flags);
 
     if (n < 0) {
       if (errno == EINTR)
@@ -58,3 +112,125 @@ ssize_t io_send_buffer(int fd, const void *buf, size_t count) {
 
   return total;
 }
+
+ssize_t io_send_buffer(int fd, const void *buf, size_t count) {
+  return send_all(fd, buf, count, MSG_NOSIGNAL);
+}
+
+ssize_t io_send_more(int fd, const void *buf, size_t count) {
+  return send_all(fd, buf, count, MSG_NOSIGNAL | MSG_MORE);
+}
+
+ssize_t io_send_iov(int fd, struct iovec *iov, int iovcnt, bool more) {
+  int flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+  ssize_t total = 0;
+
+  while (iovcnt > 0) {
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = iovcnt};
+    ssize_t n = sendmsg(fd, &msg, flags);
+
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN) {
+        struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+        poll(&pfd, 1, 5000);
+        continue;
+      }
+      return total > 0 ? total : -1;
+    }
+
+    total += n;
+    while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+
+  return total;
+}
+
+// One pipe per thread, created on first splice and closed when the thread
+// exits (workers come and go as the pool scales).
+static pthread_key_t pipe_key;
+static pthread_once_t pipe_once = PTHREAD_ONCE_INIT;
+static _Thread_local int splice_pipe[2] = {-1, -1};
+
+static void pipe_release(void *arg) {
+  int *fds = arg;
+  close(fds[0]);
+  close(fds[1]);
+  fds[0] = fds[1] = -1;
+}
+
+static void pipe_key_init(void) {
+  pthread_key_create(&pipe_key, pipe_release);
+}
+
+static bool pipe_get(void) {
+  if (splice_pipe[0] >= 0)
+    return true;
+
+  pthread_once(&pipe_once, pipe_key_init);
+  if (pipe2(splice_pipe, O_NONBLOCK | O_CLOEXEC) < 0)
+    return false;
+  pthread_setspecific(pipe_key, splice_pipe);
+  return true;
+}
+
+static bool wait_fd(int fd, short events) {
+  struct pollfd pfd = {.fd = fd, .events = events};
+  int ready = poll(&pfd, 1, IO_SPLICE_TIMEOUT_MS);
+  if (ready == 0)
+    errno = ETIMEDOUT;
+  return ready > 0 || (ready < 0 && errno == EINTR);
+}
+
+ssize_t io_splice(int out_fd, int in_fd, size_t count) {
+  if (!pipe_get())
+    return -1;
+
+  ssize_t total = 0;
+  while (count > 0) {
+    size_t chunk = count < IO_SPLICE_CHUNK ? count : IO_SPLICE_CHUNK;
+    ssize_t n = splice(in_fd, NULL, splice_pipe[1], NULL, chunk,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN && wait_fd(in_fd, POLLIN))
+        continue;
+      return total > 0 ? total : -1;
+    }
+    if (n == 0)
+      break; // EOF
+
+    // Empty the pipe before reading more, so it never holds bytes that
+    // belong to another transfer.
+    size_t left = n;
+    while (left > 0) {
+      ssize_t m = splice(splice_pipe[0], NULL, out_fd, NULL, left,
+                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (m < 0) {
+        if (errno == EINTR)
+          continue;
+        if (errno == EAGAIN && wait_fd(out_fd, POLLOUT))
+          continue;
+        pipe_release(splice_pipe); // Stale bytes; start over next time
+        return -1;
+      }
+      left -= m;
+    }
+
+    total += n;
+    if (count != SIZE_MAX)
+      count -= n;
+  }
+
+  return total;
+}
@@ -1,10 +1,35 @@
 #ifndef IO_H
 #define IO_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 ssize_t io_send_file(int out_fd, int in_fd, off_t offset, size_t count);
+
+// Like io_send_file, but stops at EAGAIN instead of waiting, setting
+// *blocked. Returns the bytes sent, possibly 0.
+ssize_t io_send_file_nowait(int out_fd, int in_fd, off_t offset, size_t count,
+                            bool *blocked);
+
+// Readahead for a large body sent in pieces ending at end: SEQUENTIAL on
+// the first call (*advised starts at -1), then WILLNEED kept one
+// IO_READAHEAD_WINDOW ahead of offset. Call before each piece.
+void io_advise(int in_fd, off_t offset, off_t end, off_t *advised);
 ssize_t io_send_buffer(int fd, const void *buf, size_t count);
 
+// Like io_send_buffer, but hints that more data (e.g. a sendfile body)
+// follows so the kernel can coalesce it into the same segments.
+ssize_t io_send_more(int fd, const void *buf, size_t count);
+
+// Gather-write; iov is consumed (advanced) as data goes out. more has
+// the same meaning as for io_send_more.
+ssize_t io_send_iov(int fd, struct iovec *iov, int iovcnt, bool more);
+
+// Move count bytes from in_fd to out_fd through a per-thread pipe, never
+// copying them through user space. SIZE_MAX copies until EOF. Returns
+// the bytes moved, which is less than count if in_fd hit EOF.
+ssize_t io_splice(int out_fd, int in_fd, size_t count);
+
 #endif
@@ -1,37 +1,125 @@
+#include "affinity.h"
 #include "config.h"
+#include "http.h"
+#include "pack.h"
+#include "path.h"
+#include "prewarm.h"
+#include "proxy.h"
 #include "queue.h"
+#include "response.h"
 #include "server.h"
 #include "thread_pool.h"
+#include "trace.h"
+#include "upgrade.h"
 #include "utils.h"
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 static queue_t queue;
 static thread_pool_t pool;
+static affinity_t affinity;
 static int server_fd = -1;
+static int signal_pipe[2] = {-1, -1};
+static int upgrade_fd = -1; // Ready pipe of a pending upgrade
 
-void signal_handler(int sig) {
-  (void)sig;
-  log_info("Shutdown signal received");
-  if (server_fd >= 0)
+// Async-signal-safe: only hands the signal number to the accept loop.
+static void signal_handler(int sig) {
+  int saved = errno;
+  char c = (char)sig;
+  if (write(signal_pipe[1], &c, 1) < 0) {
+    // Pipe full: the accept loop already has signals to process
+  }
+  errno = saved;
+}
+
+// Stop accepting, let queued and in-flight requests finish with
+// "Connection: close", then tear down in dependency order and exit.
+static void drain_and_exit(uint64_t timeout_ms) {
+  uint64_t start = time_ms();
+
+  if (server_fd >= 0) {
     close(server_fd);
+    server_fd = -1;
+  }
+  http_begin_drain();
+
+  if (!pool_drain(&pool, timeout_ms))
+    log_error("Drain deadline passed with %zu connections in flight",
+              atomic_load(&pool.in_flight));
+
+  // Workers are joined before the queue is freed; whatever is still
+  // queued never reached a worker and is closed here.
   pool_shutdown(&pool);
+  job_t job;
+  size_t dropped = 0;
+  while (queue_dequeue(&queue, &job)) {
+    close(job.client_fd);
+    dropped++;
+  }
   queue_destroy(&queue);
+  pack_close();
+  path_cleanup();
+  proxy_cleanup();
+  response_cleanup();
+
+  if (dropped > 0)
+    log_error("Closed %zu queued connections", dropped);
+  log_info("Shutdown complete in %lums", (unsigned long)(time_ms() - start));
   exit(0);
 }
 
+static void handle_signals(void) {
+  bool stop = false;
+  bool upgrade = false;
+  char sigs[16];
+  ssize_t n;
+
+  while ((n = read(signal_pipe[0], sigs, sizeof(sigs))) > 0) {
+    for (ssize_t i = 0; i < n; i++) {
+      if (sigs[i] == SIGUSR2)
+        upgrade = true;
+      else
+        stop = true;
+    }
+  }
+
+  if (stop) {
+    log_info("Shutdown signal received, draining");
+    drain_and_exit(SHUTDOWN_DRAIN_MS);
+  }
+
+  // The accept loop keeps serving until the new process is ready.
+  if (upgrade && upgrade_fd < 0)
+    upgrade_fd = upgrade_start(server_fd);
+}
+
 int main(int argc, char **argv) {
   int port = SERVER_PORT;
   int min_threads = THREAD_MIN;
   int max_threads = THREAD_MAX;
   const char *root = "./www";
+  const char *archive = NULL;
+  const char *manifest = NULL;
+  bool prewarm = false;
+  int acceptor_cpu = -1;
+  uint64_t slow_ms = 0;
+
+  if (argc == 4 && strcmp(argv[1], "--pack") == 0)
+    return pack_build(argv[2], argv[3]) ? 0 : 1;
+
+  upgrade_init(argv);
+  affinity_init(&affinity);
 
   int opt;
-  while ((opt = getopt(argc, argv, "p:t:m:d:")) != -1) {
+  while ((opt = getopt(argc, argv, "p:t:m:d:a:wW:c:A:sT:P:")) != -1) {
     switch (opt) {
     case 'p':
       port = atoi(optarg);
@@ -45,58 +133,157 @@ int main(int argc, char **argv) {
     case 'd':
       root = optarg;
       break;
+    case 'a':
+      archive = optarg;
+      break;
+    case 'w':
+      prewarm = true;
+      break;
+    case 'W':
+      prewarm = true;
+      manifest = optarg;
+      break;
+    case 'c':
+      if (!affinity_parse(optarg, &affinity)) {
+        log_error("Invalid CPU list %s", optarg);
+        return 1;
+      }
+      break;
+    case 'A':
+      acceptor_cpu = atoi(optarg);
+      break;
+    case 's':
+      affinity.steer = true;
+      break;
+    case 'T':
+      slow_ms = strtoull(optarg, NULL, 10);
+      break;
+    case 'P':
+      if (!proxy_add_route(optarg))
+        return 1;
+      break;
     default:
-      fprintf(
-          stderr,
-          "Usage: %s [-p port] [-t min_threads] [-m max_threads] [-d root]\n",
-          argv[0]);
+      fprintf(stderr,
+              "Usage: %s [-p port] [-t min_threads] [-m max_threads] "
+              "[-d root | -a archive] [-w | -W manifest]\n"
+              "       [-c worker_cpus] [-A acceptor_cpu] [-s] [-T slow_ms]\n"
+              "       [-P /prefix=host:port]...\n"
+              "       %s --pack root archive\n",
+              argv[0], argv[0]);
       return 1;
     }
   }
 
-  if (chdir(root) < 0) {
-    log_error("Cannot change to directory %s", root);
+  if (archive) {
+    if (!pack_open(archive))
+      return 1;
+    if (prewarm)
+      pack_prewarm();
+  } else {
+    // The manifest is named relative to where we were started
+    char manifest_path[PATH_MAX];
+    if (manifest && !realpath(manifest, manifest_path)) {
+      log_error("Cannot open prewarm manifest %s: %s", manifest,
+                strerror(errno));
+      prewarm = false;
+    } else if (manifest) {
+      manifest = manifest_path;
+    }
+
+    if (chdir(root) < 0) {
+      log_error("Cannot change to directory %s", root);
+      return 1;
+    }
+
+    if (!path_init(".")) {
+      log_error("Cannot resolve document root %s", root);
+      return 1;
+    }
+
+    if (prewarm && !prewarm_run(manifest, PREWARM_THREADS))
+      log_error("Prewarm failed, continuing cold");
+  }
+
+  if (pipe2(signal_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+    log_error("Failed to create signal pipe");
     return 1;
   }
 
   signal(SIGINT, signal_handler);
   signal(SIGTERM, signal_handler);
+  signal(SIGUSR2, signal_handler);
+  signal(SIGPIPE, SIG_IGN);
+
+  trace_init(slow_ms);
+  if (!response_init())
+    return 1;
+
+  // Before queue_init, so the ring is allocated on the acceptor's node.
+  if (acceptor_cpu >= 0 && !affinity_pin_self(acceptor_cpu))
+    return 1;
 
   if (!queue_init(&queue, QUEUE_CAPACITY)) {
     log_error("Failed to initialize queue");
     return 1;
   }
 
-  if (!pool_init(&pool, &queue, min_threads, max_threads)) {
+  if (!pool_init(&pool, &queue, min_threads, max_threads, &affinity)) {
     log_error("Failed to initialize thread pool");
     queue_destroy(&queue);
     return 1;
   }
 
-  server_fd = server_create(port);
+  server_fd = upgrade_inherited_fd();
+  if (server_fd < 0)
+    server_fd = server_create(port);
   if (server_fd < 0) {
     pool_shutdown(&pool);
     queue_destroy(&queue);
     return 1;
   }
 
-  log_info("Server ready. Press Ctrl+C to stop.");
+  upgrade_ready();
+  log_info("Server ready. Press Ctrl+C to stop. SIGUSR2 to upgrade.");
 
   while (1) {
+    struct pollfd pfds[3] = {{.fd = server_fd, .events = POLLIN},
+                             {.fd = signal_pipe[0], .events = POLLIN},
+                             {.fd = upgrade_fd, .events = POLLIN}};
+    if (poll(pfds, 3, upgrade_timeout_ms()) < 0)
+      continue;
+
+    if (pfds[1].revents & POLLIN) {
+      handle_signals();
+      continue;
+    }
+
+    if (upgrade_fd >= 0 && (pfds[2].revents || upgrade_timeout_ms() == 0)) {
+      upgrade_fd = -1;
+      if (upgrade_finish())
+        drain_and_exit(UPGRADE_DRAIN_MS);
+      continue;
+    }
+
+    if (!(pfds[0].revents & POLLIN))
+      continue;
+
     struct sockaddr_in client_addr;
     int client_fd = server_accept(server_fd, &client_addr);
 
     if (client_fd < 0) {
-      if (errno == EINTR)
+      if (errno == EINTR || errno == EAGAIN)
         continue;
       usleep(1000);
       continue;
     }
+    TRACE_PROBE1(accept, client_fd);
 
     job_t job = {.client_fd = client_fd,
                  .enqueue_time = time_ms(),
                  .keep_alive = true,
-                 .timeout_ms = KEEPALIVE_TIMEOUT_MS};
+                 .timeout_ms = KEEPALIVE_TIMEOUT_MS,
+                 .cpu = affinity.steer ? affinity_incoming_cpu(client_fd) : -1,
+                 .accept_ticks = trace_now()};
     pool_submit(&pool, job);
   }
 
@@ -0,0 +1,17 @@
+#ifndef MIME_HASH_H
+#define MIME_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Seeded FNV-1a over an ASCII-lowercased file extension. Shared by
+// tools/mime_gen.c, which searches for the seeds, and the lookup in
+// response.c, so the two can never disagree.
+static inline uint32_t mime_hash(const char *ext, size_t len, uint32_t seed) {
+  uint32_t h = 2166136261u ^ (seed * 0x9e3779b9u);
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ (uint8_t)(ext[i] | 0x20)) * 16777619u;
+  return h ^ (h >> 15);
+}
+
+#endif
@@ -0,0 +1,441 @@
+#include "pack.h"
+#include "config.h"
+#include "path.h"
+#include "response.h"
+#include "utils.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+
+static int archive_fd = -1;
+static const char *archive_base;
+static size_t archive_size;
+static const pack_header_t *archive_hdr;
+static const pack_entry_t *archive_entries;
+static const uint32_t *archive_buckets;
+
+static uint64_t fnv1a(const void *data, size_t len, uint64_t h) {
+  const unsigned char *p = data;
+  for (size_t i = 0; i < len; i++) {
+    h ^= p[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+typedef struct {
+  char *rel;
+  char etag[24];
+  pack_entry_t entry;
+} pack_file_t;
+
+typedef struct {
+  pack_file_t *files;
+  size_t count;
+  size_t capacity;
+} pack_list_t;
+
+static bool add_file(pack_list_t *list, const char *rel) {
+  if (list->count == list->capacity) {
+    size_t cap = list->capacity ? list->capacity * 2 : 64;
+    pack_file_t *files = realloc(list->files, cap * sizeof(*files));
+    if (!files)
+      return false;
+    list->files = files;
+    list->capacity = cap;
+  }
+  pack_file_t *f = &list->files[list->count++];
+  memset(f, 0, sizeof(*f));
+  f->rel = strdup(rel);
+  return f->rel != NULL;
+}
+
+// Walk the tree under the root path_init() holds, with the same symlink
+// rules as file mode: a link is packed only if path_open() accepts it,
+// i.e. it resolves to a regular file beneath the root. Directory links
+// are never followed, so a link to an ancestor cannot loop.
+static bool collect(pack_list_t *list, const char *rel) {
+  int dir_fd = path_open(*rel ? rel : ".", O_RDONLY | O_DIRECTORY);
+  DIR *dir = dir_fd < 0 ? NULL : fdopendir(dir_fd);
+  if (!dir) {
+    log_error("opendir %s: %s", *rel ? rel : ".", strerror(errno));
+    if (dir_fd >= 0)
+      close(dir_fd);
+    return false;
+  }
+
+  bool ok = true;
+  struct dirent *de;
+  while (ok && (de = readdir(dir)) != NULL) {
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+      continue;
+
+    char child[PATH_MAX_LEN];
+    int n = *rel ? snprintf(child, sizeof(child), "%s/%s", rel, de->d_name)
+                 : snprintf(child, sizeof(child), "%s", de->d_name);
+    if (n < 0 || (size_t)n >= sizeof(child))
+      continue;
+
+    struct stat st;
+    if (fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+      continue;
+
+    if (S_ISDIR(st.st_mode)) {
+      ok = collect(list, child);
+    } else if (S_ISREG(st.st_mode)) {
+      ok = add_file(list, child);
+    } else if (S_ISLNK(st.st_mode)) {
+      int fd = path_open(child, O_RDONLY | O_NONBLOCK);
+      if (fd < 0) {
+        log_error("Skipping %s: %s", child,
+                  errno == EXDEV ? "links outside the root" : strerror(errno));
+        continue;
+      }
+      bool regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+      close(fd);
+      if (regular)
+        ok = add_file(list, child);
+      else
+        log_error("Skipping %s: not a regular file", child);
+    }
+  }
+
+  closedir(dir);
+  return ok;
+}
+
+static int file_cmp(const void *a, const void *b) {
+  return strcmp(((const pack_file_t *)a)->rel, ((const pack_file_t *)b)->rel);
+}
+
+static pack_file_t *find_file(pack_list_t *list, const char *rel) {
+  pack_file_t key = {.rel = (char *)rel};
+  return bsearch(&key, list->files, list->count, sizeof(pack_file_t),
+                 file_cmp);
+}
+
+static pack_span_t put(FILE *out, const void *data, size_t len) {
+  pack_span_t span = {.off = (uint64_t)ftello(out), .len = len};
+  fwrite(data, 1, len, out);
+  return span;
+}
+
+static bool put_body(FILE *out, pack_file_t *f) {
+  int fd = path_open(f->rel, O_RDONLY);
+  if (fd < 0) {
+    log_error("open %s: %s", f->rel, strerror(errno));
+    return false;
+  }
+
+  pack_span_t span = {.off = (uint64_t)ftello(out), .len = 0};
+  uint64_t hash = FNV_OFFSET;
+  char buf[BUFFER_SIZE];
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) > 0) {
+    hash = fnv1a(buf, n, hash);
+    fwrite(buf, 1, n, out);
+    span.len += n;
+  }
+  close(fd);
+
+  if (n < 0) {
+    log_error("read %s: %s", f->rel, strerror(errno));
+    return false;
+  }
+
+  f->entry.body[PACK_IDENTITY] = span;
+  snprintf(f->etag, sizeof(f->etag), "\"%016" PRIx64 "\"", hash);
+  return true;
+}
+
+static void put_meta(FILE *out, pack_list_t *list, pack_file_t *f) {
+  pack_entry_t *e = &f->entry;
+  const char *mime = response_mime(f->rel)->type;
+
+  char gz_rel[PATH_MAX_LEN];
+  snprintf(gz_rel, sizeof(gz_rel), "%s.gz", f->rel);
+  pack_file_t *gz = find_file(list, gz_rel);
+
+  e->hash = fnv1a(f->rel, strlen(f->rel), FNV_OFFSET);
+  e->path = put(out, f->rel, strlen(f->rel));
+  e->mime = put(out, mime, strlen(mime));
+  e->etag[PACK_IDENTITY] = put(out, f->etag, strlen(f->etag));
+
+  char header[BUFFER_SIZE];
+  int n = snprintf(header, sizeof(header),
+                   "Content-Type: %s\r\n"
+                   "Content-Length: %" PRIu64 "\r\n"
+                   "ETag: %s\r\n"
+                   "%s",
+                   mime, e->body[PACK_IDENTITY].len, f->etag,
+                   gz ? "Vary: Accept-Encoding\r\n" : "");
+  e->headers[PACK_IDENTITY] = put(out, header, n);
+
+  if (!gz)
+    return;
+
+  // Share the .gz file's body bytes; only its headers differ.
+  e->body[PACK_GZIP] = gz->entry.body[PACK_IDENTITY];
+  e->etag[PACK_GZIP] = put(out, gz->etag, strlen(gz->etag));
+  n = snprintf(header, sizeof(header),
+               "Content-Type: %s\r\n"
+               "Content-Encoding: gzip\r\n"
+               "Content-Length: %" PRIu64 "\r\n"
+               "ETag: %s\r\n"
+               "Vary: Accept-Encoding\r\n",
+               mime, e->body[PACK_GZIP].len, gz->etag);
+  e->headers[PACK_GZIP] = put(out, header, n);
+}
+
+static void put_pad(FILE *out, size_t align) {
+  static const char zero[8];
+  size_t off = (size_t)ftello(out);
+  if (off % align)
+    fwrite(zero, 1, align - off % align, out);
+}
+
+bool pack_build(const char *root, const char *out_path) {
+  if (!path_init(root))
+    return false;
+
+  pack_list_t list = {0};
+  bool ok = collect(&list, "");
+
+  if (ok && list.count > UINT32_MAX / 4) {
+    log_error("Too many files under %s", root);
+    ok = false;
+  }
+
+  // Written beside out_path and renamed over it, so a server that has
+  // the old archive mapped keeps reading intact pages.
+  char tmp_path[PATH_MAX_LEN];
+  FILE *out = NULL;
+  if (ok && snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", out_path) >=
+                (int)sizeof(tmp_path)) {
+    log_error("Archive path too long: %s", out_path);
+    ok = false;
+  }
+  if (ok) {
+    int fd = mkstemp(tmp_path);
+    mode_t mask = umask(0);
+    umask(mask);
+    if (fd >= 0 && (fchmod(fd, 0666 & ~mask) < 0 ||
+                    !(out = fdopen(fd, "wb")))) {
+      close(fd);
+      unlink(tmp_path);
+    }
+    if (!out) {
+      log_error("Create %s: %s", tmp_path, strerror(errno));
+      ok = false;
+    }
+  }
+
+  if (ok) {
+    qsort(list.files, list.count, sizeof(pack_file_t), file_cmp);
+
+    pack_header_t hdr = {.version = PACK_VERSION,
+                         .entry_count = list.count};
+    memcpy(hdr.magic, PACK_MAGIC, sizeof(hdr.magic));
+    hdr.bucket_count = 16;
+    while (hdr.bucket_count < list.count * 2)
+      hdr.bucket_count <<= 1;
+
+    fwrite(&hdr, sizeof(hdr), 1, out);
+
+    for (size_t i = 0; ok && i < list.count; i++)
+      ok = put_body(out, &list.files[i]);
+
+    for (size_t i = 0; ok && i < list.count; i++)
+      put_meta(out, &list, &list.files[i]);
+
+    uint32_t *buckets = ok ? calloc(hdr.bucket_count, sizeof(uint32_t)) : NULL;
+    if (ok && !buckets)
+      ok = false;
+
+    if (ok) {
+      put_pad(out, 8);
+      hdr.entries_off = (uint64_t)ftello(out);
+      for (size_t i = 0; i < list.count; i++) {
+        pack_entry_t *e = &list.files[i].entry;
+        fwrite(e, sizeof(*e), 1, out);
+
+        uint32_t mask = hdr.bucket_count - 1;
+        uint32_t slot = (uint32_t)e->hash & mask;
+        while (buckets[slot])
+          slot = (slot + 1) & mask;
+        buckets[slot] = (uint32_t)i + 1;
+      }
+
+      hdr.buckets_off = (uint64_t)ftello(out);
+      fwrite(buckets, sizeof(uint32_t), hdr.bucket_count, out);
+
+      fseeko(out, 0, SEEK_SET);
+      fwrite(&hdr, sizeof(hdr), 1, out);
+    }
+    free(buckets);
+
+    bool write_failed = fflush(out) != 0 || ferror(out) != 0 ||
+                        fsync(fileno(out)) < 0;
+    if (fclose(out) != 0 || write_failed) {
+      log_error("write %s: %s", tmp_path, strerror(errno));
+      ok = false;
+    }
+    if (ok && rename(tmp_path, out_path) < 0) {
+      log_error("rename %s: %s", out_path, strerror(errno));
+      ok = false;
+    }
+    if (!ok)
+      unlink(tmp_path);
+    else
+      log_info("Packed %zu files from %s into %s", list.count, root,
+               out_path);
+  }
+
+  for (size_t i = 0; i < list.count; i++)
+    free(list.files[i].rel);
+  free(list.files);
+  path_cleanup();
+  return ok;
+}
+
+static bool span_valid(pack_span_t span) {
+  return span.off <= archive_size && span.len <= archive_size - span.off;
+}
+
+bool pack_open(const char *path) {
+  archive_fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (archive_fd < 0) {
+    log_error("open %s: %s", path, strerror(errno));
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(archive_fd, &st) < 0 ||
+      (size_t)st.st_size < sizeof(pack_header_t)) {
+    log_error("Invalid archive %s", path);
+    pack_close();
+    return false;
+  }
+  archive_size = st.st_size;
+
+  void *base = mmap(NULL, archive_size, PROT_READ, MAP_SHARED, archive_fd, 0);
+  if (base == MAP_FAILED) {
+    log_error("mmap %s: %s", path, strerror(errno));
+    archive_size = 0;
+    pack_close();
+    return false;
+  }
+  archive_base = base;
+  archive_hdr = base;
+
+  const pack_header_t *h = archive_hdr;
+  bool valid = memcmp(h->magic, PACK_MAGIC, sizeof(h->magic)) == 0 &&
+               h->version == PACK_VERSION && h->bucket_count > 0 &&
+               (h->bucket_count & (h->bucket_count - 1)) == 0 &&
+               h->entries_off % 8 == 0 &&
+               span_valid((pack_span_t){h->entries_off,
+                                        (uint64_t)h->entry_count *
+                                            sizeof(pack_entry_t)}) &&
+               span_valid((pack_span_t){h->buckets_off,
+                                        (uint64_t)h->bucket_count *
+                                            sizeof(uint32_t)});
+  if (!valid) {
+    log_error("Invalid archive %s", path);
+    pack_close();
+    return false;
+  }
+
+  archive_entries = (const pack_entry_t *)(archive_base + h->entries_off);
+  archive_buckets = (const uint32_t *)(archive_base + h->buckets_off);
+
+  for (uint32_t i = 0; i < h->entry_count; i++) {
+    const pack_entry_t *e = &archive_entries[i];
+    bool ok = span_valid(e->path) && span_valid(e->mime);
+    for (int v = 0; v < PACK_VARIANTS; v++)
+      ok = ok && span_valid(e->etag[v]) && span_valid(e->headers[v]) &&
+           span_valid(e->body[v]);
+    if (!ok) {
+      log_error("Corrupt entry %u in archive %s", i, path);
+      pack_close();
+      return false;
+    }
+  }
+
+  log_info("Serving %u files from archive %s (%zu bytes)", h->entry_count,
+           path, archive_size);
+  return true;
+}
+
+void pack_close(void) {
+  if (archive_base)
+    munmap((void *)archive_base, archive_size);
+  if (archive_fd >= 0)
+    close(archive_fd);
+  archive_fd = -1;
+  archive_base = NULL;
+  archive_hdr = NULL;
+  archive_entries = NULL;
+  archive_buckets = NULL;
+  archive_size = 0;
+}
+
+bool pack_enabled(void) { return archive_hdr != NULL; }
+
+int pack_fd(void) { return archive_fd; }
+
+const char *pack_data(pack_span_t span) { return archive_base + span.off; }
+
+void pack_prewarm(void) {
+  uint64_t start = time_ms();
+  readahead(archive_fd, 0, archive_size);
+  madvise((void *)archive_base, archive_size, MADV_WILLNEED);
+  log_info("Prewarmed archive (%.1f MB) in %lums",
+           archive_size / (1024.0 * 1024.0),
+           (unsigned long)(time_ms() - start));
+}
+
+static const pack_entry_t *probe(const char *rel, size_t len) {
+  uint64_t hash = fnv1a(rel, len, FNV_OFFSET);
+  uint32_t mask = archive_hdr->bucket_count - 1;
+
+  uint32_t slot = (uint32_t)hash & mask;
+
+  for (uint32_t n = 0; n < archive_hdr->bucket_count; n++) {
+    uint32_t idx = archive_buckets[slot];
+    if (idx == 0 || idx > archive_hdr->entry_count)
+      return NULL;
+
+    const pack_entry_t *e = &archive_entries[idx - 1];
+    if (e->hash == hash && e->path.len == len &&
+        memcmp(pack_data(e->path), rel, len) == 0)
+      return e;
+    slot = (slot + 1) & mask;
+  }
+
+  return NULL;
+}
+
+const pack_entry_t *pack_lookup(const char *rel) {
+  if (strcmp(rel, ".") == 0)
+    return probe("index.html", 10);
+
+  size_t len = strlen(rel);
+  const pack_entry_t *e = probe(rel, len);
+  if (e)
+    return e;
+
+  char index_path[PATH_MAX_LEN];
+  int n = snprintf(index_path, sizeof(index_path), "%s/index.html", rel);
+  if (n < 0 || (size_t)n >= sizeof(index_path))
+    return NULL;
+  return probe(index_path, n);
+}
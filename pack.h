@@ -0,0 +1,54 @@
+#ifndef PACK_H
+#define PACK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PACK_MAGIC "SPAK"
+#define PACK_VERSION 1
+
+enum { PACK_IDENTITY, PACK_GZIP, PACK_VARIANTS };
+
+// All offsets are relative to the start of the archive file.
+typedef struct {
+  uint64_t off;
+  uint64_t len;
+} pack_span_t;
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t entry_count;
+  uint32_t bucket_count; // Power of two, linear probing
+  uint64_t entries_off;
+  uint64_t buckets_off; // uint32_t[bucket_count], entry index + 1
+} pack_header_t;
+
+typedef struct {
+  uint64_t hash; // FNV-1a of path
+  pack_span_t path;
+  pack_span_t mime;
+  pack_span_t etag[PACK_VARIANTS];
+  pack_span_t headers[PACK_VARIANTS]; // Pre-rendered header lines
+  pack_span_t body[PACK_VARIANTS];    // len 0 if variant absent
+} pack_entry_t;
+
+// Offline: pack every regular file under root into out_path. A sibling
+// "name.gz" becomes the precompressed variant of "name". Symlinks are
+// packed only when they resolve to a file beneath root.
+bool pack_build(const char *root, const char *out_path);
+
+bool pack_open(const char *path);
+void pack_close(void);
+bool pack_enabled(void);
+
+// rel is a path_normalize()d path; directories resolve to index.html.
+const pack_entry_t *pack_lookup(const char *rel);
+const char *pack_data(pack_span_t span);
+int pack_fd(void);
+
+// Ask the kernel to page the whole archive in ahead of first use.
+void pack_prewarm(void);
+
+#endif
@@ -0,0 +1,187 @@
+#include "path.h"
+#include "utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifdef SYS_openat2
+#include <linux/openat2.h>
+#endif
+
+static int root_fd = -1;
+static char root_abs[PATH_MAX];
+static size_t root_len;
+static _Atomic bool have_openat2 = true;
+
+bool path_init(const char *root) {
+  if (!realpath(root, root_abs)) {
+    log_error("realpath %s: %s", root, strerror(errno));
+    return false;
+  }
+  root_len = strlen(root_abs);
+
+  root_fd = open(root_abs, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (root_fd < 0) {
+    log_error("open %s: %s", root_abs, strerror(errno));
+    return false;
+  }
+
+  return true;
+}
+
+void path_cleanup(void) {
+  if (root_fd >= 0)
+    close(root_fd);
+  root_fd = -1;
+}
+
+static int hex_value(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+bool path_normalize(const char *requested, char *out, size_t out_len) {
+  if (out_len < 2)
+    return false;
+
+  // seg[] holds the offset in out where each emitted segment starts, so
+  // ".." can pop back to the previous one.
+  size_t seg[PATH_MAX / 2];
+  size_t depth = 0;
+  size_t len = 0;
+  size_t start = 0;
+  size_t name = 0;
+  bool in_seg = false;
+  const char *p = requested;
+
+  while (1) {
+    char c = *p;
+    bool end = c == '\0' || c == '?' || c == '#';
+
+    if (!end) {
+      p++;
+      if (c == '%') {
+        int hi = hex_value(p[0]);
+        int lo = hi < 0 ? -1 : hex_value(p[1]);
+        if (lo < 0)
+          return false;
+        c = (char)(hi << 4 | lo);
+        p += 2;
+        if (c == '\0')
+          return false;
+      }
+    }
+
+    // A decoded '/' separates segments exactly like a literal one.
+    if (end || c == '/') {
+      if (in_seg) {
+        size_t n = len - name;
+        if (n == 1 && out[name] == '.') {
+          len = start;
+        } else if (n == 2 && out[name] == '.' && out[name + 1] == '.') {
+          if (depth == 0)
+            return false;
+          len = seg[--depth];
+        } else {
+          if (depth >= sizeof(seg) / sizeof(seg[0]))
+            return false;
+          seg[depth++] = start;
+        }
+        in_seg = false;
+      }
+      if (end)
+        break;
+      continue;
+    }
+
+    if (!in_seg) {
+      start = len;
+      if (len > 0) {
+        if (len + 1 >= out_len)
+          return false;
+        out[len++] = '/';
+      }
+      name = len;
+      in_seg = true;
+    }
+
+    if (len + 1 >= out_len)
+      return false;
+    out[len++] = c;
+  }
+
+  if (len == 0)
+    out[len++] = '.';
+  out[len] = '\0';
+  return true;
+}
+
+// Ask the kernel where an fd landed.
+static bool fd_beneath_root(int fd) {
+  char link[64];
+  char target[PATH_MAX];
+  snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+  ssize_t n = readlink(link, target, sizeof(target) - 1);
+  if (n < 0)
+    return false;
+  target[n] = '\0';
+
+  return strncmp(target, root_abs, root_len) == 0 &&
+         (target[root_len] == '/' || target[root_len] == '\0');
+}
+
+// Resolve with plain openat, following absolute symlinks from /, and
+// accept the result only if it lands beneath the root. The O_PATH open
+// has no side effects on whatever it reaches (FIFOs, devices); the real
+// open goes through the checked fd.
+static int open_checked(const char *rel, int flags) {
+  int path_fd = openat(root_fd, rel, O_PATH | O_CLOEXEC);
+  if (path_fd < 0)
+    return -1;
+
+  if (!fd_beneath_root(path_fd)) {
+    close(path_fd);
+    errno = EXDEV;
+    return -1;
+  }
+
+  char link[64];
+  snprintf(link, sizeof(link), "/proc/self/fd/%d", path_fd);
+  int fd = open(link, flags);
+  int saved = errno;
+  close(path_fd);
+  errno = saved;
+  return fd;
+}
+
+int path_open(const char *rel, int flags) {
+  flags |= O_CLOEXEC;
+
+#ifdef SYS_openat2
+  // RESOLVE_BENEATH also rejects absolute symlinks that point back inside
+  // the root; those retry through open_checked so the answer does not
+  // depend on whether the kernel has openat2.
+  if (atomic_load_explicit(&have_openat2, memory_order_relaxed)) {
+    struct open_how how = {.flags = (uint64_t)flags,
+                           .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS};
+    int fd = syscall(SYS_openat2, root_fd, rel, &how, sizeof(how));
+    if (fd >= 0 || (errno != ENOSYS && errno != EPERM && errno != EXDEV))
+      return fd;
+    if (errno != EXDEV)
+      atomic_store_explicit(&have_openat2, false, memory_order_relaxed);
+  }
+#endif
+
+  return open_checked(rel, flags);
+}
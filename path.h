@@ -0,0 +1,21 @@
+#ifndef PATH_H
+#define PATH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Canonicalize the document root once and hold a directory fd on it.
+bool path_init(const char *root);
+void path_cleanup(void);
+
+// Lexically normalize a request target into a root-relative path:
+// strips query/fragment, percent-decodes, collapses "." and "..".
+// No syscalls. Returns false if the path would escape the root.
+bool path_normalize(const char *requested, char *out, size_t out_len);
+
+// Open a normalized path beneath the root. Symlinks, relative or
+// absolute, are followed; any that resolve outside the root fail with
+// errno == EXDEV.
+int path_open(const char *rel, int flags);
+
+#endif
@@ -0,0 +1,215 @@
+#include "prewarm.h"
+#include "config.h"
+#include "path.h"
+#include "utils.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef struct {
+  char **items;
+  size_t count;
+  size_t capacity;
+
+  // Walk mode: items is a stack of directories still to scan
+  size_t busy;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+
+  // Manifest mode: items is a fixed list claimed by index
+  _Atomic size_t next;
+
+  _Atomic size_t files;
+  _Atomic size_t dirs;
+  _Atomic uint64_t bytes;
+} prewarm_t;
+
+static bool push(prewarm_t *w, const char *path) {
+  if (w->count == w->capacity) {
+    size_t cap = w->capacity ? w->capacity * 2 : 64;
+    char **items = realloc(w->items, cap * sizeof(*items));
+    if (!items)
+      return false;
+    w->items = items;
+    w->capacity = cap;
+  }
+  char *copy = strdup(path);
+  if (!copy)
+    return false;
+  w->items[w->count++] = copy;
+  return true;
+}
+
+static void warm_fd(prewarm_t *w, int fd, size_t max) {
+  struct stat st;
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+    return;
+
+  if ((size_t)st.st_size <= max) {
+    readahead(fd, 0, st.st_size);
+    atomic_fetch_add_explicit(&w->bytes, st.st_size, memory_order_relaxed);
+  }
+  atomic_fetch_add_explicit(&w->files, 1, memory_order_relaxed);
+}
+
+static void scan_dir(prewarm_t *w, const char *rel) {
+  int fd = path_open(rel, O_RDONLY | O_DIRECTORY);
+  if (fd < 0)
+    return;
+
+  DIR *dir = fdopendir(fd);
+  if (!dir) {
+    close(fd);
+    return;
+  }
+  atomic_fetch_add_explicit(&w->dirs, 1, memory_order_relaxed);
+
+  struct dirent *de;
+  while ((de = readdir(dir)) != NULL) {
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+      continue;
+
+    struct stat st;
+    if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+      continue;
+
+    if (S_ISDIR(st.st_mode)) {
+      char child[PATH_MAX_LEN];
+      int n = snprintf(child, sizeof(child), "%s/%s", rel, de->d_name);
+      if (n < 0 || (size_t)n >= sizeof(child))
+        continue;
+
+      pthread_mutex_lock(&w->mutex);
+      if (push(w, child))
+        pthread_cond_signal(&w->cond);
+      pthread_mutex_unlock(&w->mutex);
+    } else if (S_ISREG(st.st_mode)) {
+      int file_fd = openat(fd, de->d_name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+      if (file_fd >= 0) {
+        warm_fd(w, file_fd, PREWARM_MAX_FILE);
+        close(file_fd);
+      }
+    }
+  }
+
+  closedir(dir);
+}
+
+static void *walk_thread(void *arg) {
+  prewarm_t *w = arg;
+
+  pthread_mutex_lock(&w->mutex);
+  while (1) {
+    while (w->count == 0 && w->busy > 0)
+      pthread_cond_wait(&w->cond, &w->mutex);
+    if (w->count == 0)
+      break;
+
+    char *rel = w->items[--w->count];
+    w->busy++;
+    pthread_mutex_unlock(&w->mutex);
+
+    scan_dir(w, rel);
+    free(rel);
+
+    pthread_mutex_lock(&w->mutex);
+    if (--w->busy == 0 && w->count == 0)
+      pthread_cond_broadcast(&w->cond);
+  }
+  pthread_mutex_unlock(&w->mutex);
+
+  return NULL;
+}
+
+static void *manifest_thread(void *arg) {
+  prewarm_t *w = arg;
+
+  while (1) {
+    size_t i = atomic_fetch_add_explicit(&w->next, 1, memory_order_relaxed);
+    if (i >= w->count)
+      break;
+
+    int fd = path_open(w->items[i], O_RDONLY);
+    if (fd >= 0) {
+      warm_fd(w, fd, SIZE_MAX);
+      close(fd);
+    }
+  }
+
+  return NULL;
+}
+
+static bool load_manifest(prewarm_t *w, const char *manifest) {
+  FILE *f = fopen(manifest, "r");
+  if (!f) {
+    log_error("Cannot open prewarm manifest %s: %s", manifest,
+              strerror(errno));
+    return false;
+  }
+
+  char line[PATH_MAX_LEN];
+  bool ok = true;
+  while (ok && fgets(line, sizeof(line), f)) {
+    // Take the request target from access-log lines, else the first token
+    char *p = strstr(line, "GET ");
+    p = p ? p + 4 : line;
+    p += strspn(p, " \t");
+    p[strcspn(p, " \t\r\n\"")] = '\0';
+    if (!*p || *p == '#')
+      continue;
+
+    char rel[PATH_MAX_LEN];
+    if (path_normalize(p, rel, sizeof(rel)))
+      ok = push(w, rel);
+  }
+
+  fclose(f);
+  return ok;
+}
+
+bool prewarm_run(const char *manifest, int threads) {
+  prewarm_t w = {0};
+  pthread_mutex_init(&w.mutex, NULL);
+  pthread_cond_init(&w.cond, NULL);
+  atomic_init(&w.next, 0);
+  atomic_init(&w.files, 0);
+  atomic_init(&w.dirs, 0);
+  atomic_init(&w.bytes, 0);
+
+  bool ok = manifest ? load_manifest(&w, manifest) : push(&w, ".");
+  uint64_t start = time_ms();
+
+  pthread_t *tids = ok ? calloc(threads, sizeof(pthread_t)) : NULL;
+  int started = 0;
+  if (tids) {
+    for (; started < threads; started++) {
+      if (pthread_create(&tids[started], NULL,
+                         manifest ? manifest_thread : walk_thread, &w) != 0)
+        break;
+    }
+    for (int i = 0; i < started; i++)
+      pthread_join(tids[i], NULL);
+    free(tids);
+  }
+  ok = ok && started > 0;
+
+  if (ok)
+    log_info("Prewarmed %zu files in %zu dirs (%.1f MB) in %lums",
+             atomic_load(&w.files), atomic_load(&w.dirs),
+             atomic_load(&w.bytes) / (1024.0 * 1024.0),
+             (unsigned long)(time_ms() - start));
+
+  for (size_t i = 0; i < w.count; i++)
+    free(w.items[i]);
+  free(w.items);
+  pthread_mutex_destroy(&w.mutex);
+  pthread_cond_destroy(&w.cond);
+  return ok;
+}
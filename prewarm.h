@@ -0,0 +1,13 @@
+#ifndef PREWARM_H
+#define PREWARM_H
+
+#include <stdbool.h>
+
+// Warm the dentry/inode and page caches before serving. With no manifest
+// the whole docroot is walked in parallel and files up to PREWARM_MAX_FILE
+// are read ahead. A manifest lists hot paths one per line; access-log
+// lines ("GET /path HTTP/1.1") are accepted too, and those files are read
+// ahead in full. Requires path_init().
+bool prewarm_run(const char *manifest, int threads);
+
+#endif
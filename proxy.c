@@ -0,0 +1,570 @@
+#include "proxy.h"
+#include "io.h"
+#include "path.h"
+#include "response.h"
+#include "trace.h"
+#include "utils.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static proxy_route_t routes[PROXY_MAX_ROUTES];
+static size_t route_count;
+static _Thread_local _Atomic int *published;
+
+// Upstream response bytes read into user space: the status line and
+// headers, plus chunk-size lines. Bodies bypass it through io_splice().
+typedef struct {
+  int fd;
+  size_t start; // Unconsumed bytes are buf[start, end)
+  size_t end;
+  char buf[BUFFER_SIZE];
+} upstream_t;
+
+typedef enum { BODY_NONE, BODY_LENGTH, BODY_CHUNKED, BODY_UNTIL_CLOSE } body_t;
+
+// Connection-scoped headers that must not be forwarded in either direction.
+static const char *const hop_by_hop[] = {
+    "Connection:", "Keep-Alive:", "Proxy-Connection:", "Proxy-Authorization:",
+    "TE:",         "Trailer:",    "Upgrade:",          "HTTP2-Settings:",
+};
+
+bool proxy_add_route(const char *spec) {
+  const char *eq = strchr(spec, '=');
+  const char *colon = eq ? strrchr(eq + 1, ':') : NULL;
+  if (spec[0] != '/' || !colon || colon == eq + 1 || !colon[1]) {
+    log_error("Invalid route %s, expected /prefix=host:port", spec);
+    return false;
+  }
+  if (route_count == PROXY_MAX_ROUTES) {
+    log_error("More than %d routes", PROXY_MAX_ROUTES);
+    return false;
+  }
+
+  proxy_route_t *r = &routes[route_count];
+  char prefix[PATH_MAX_LEN];
+  snprintf(prefix, sizeof(prefix), "%.*s", (int)(eq - spec), spec);
+  if (!path_normalize(prefix, r->prefix, sizeof(r->prefix))) {
+    log_error("Invalid route prefix %s", prefix);
+    return false;
+  }
+  if (strcmp(r->prefix, ".") == 0)
+    r->prefix[0] = '\0';
+  r->prefix_len = strlen(r->prefix);
+
+  // "[::1]:8080" and "localhost:8080"
+  const char *host = eq + 1;
+  size_t host_len = colon - host;
+  if (host_len > 2 && host[0] == '[' && host[host_len - 1] == ']') {
+    host++;
+    host_len -= 2;
+  }
+  snprintf(r->host, sizeof(r->host), "%.*s", (int)host_len, host);
+
+  struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+  struct addrinfo *res;
+  int rc = getaddrinfo(r->host, colon + 1, &hints, &res);
+  if (rc != 0) {
+    log_error("Cannot resolve %s: %s", r->host, gai_strerror(rc));
+    return false;
+  }
+  memcpy(&r->addr, res->ai_addr, res->ai_addrlen);
+  r->addr_len = res->ai_addrlen;
+  freeaddrinfo(res);
+
+  pthread_mutex_init(&r->mutex, NULL);
+  route_count++;
+  log_info("Proxying /%s to %s:%s", r->prefix, r->host, colon + 1);
+  return true;
+}
+
+void proxy_cleanup(void) {
+  for (size_t i = 0; i < route_count; i++) {
+    proxy_route_t *r = &routes[i];
+    while (r->idle_count > 0)
+      close(r->idle[--r->idle_count]);
+    pthread_mutex_destroy(&r->mutex);
+  }
+  route_count = 0;
+}
+
+void proxy_thread_init(_Atomic int *upstream_fd) { published = upstream_fd; }
+
+static void publish(int up) {
+  if (published)
+    atomic_store_explicit(published, up, memory_order_relaxed);
+}
+
+// Unpublished before the fd number can be reused.
+static void upstream_close(int up) {
+  publish(-1);
+  close(up);
+}
+
+proxy_route_t *proxy_match(const char *path) {
+  proxy_route_t *best = NULL;
+
+  for (size_t i = 0; i < route_count; i++) {
+    proxy_route_t *r = &routes[i];
+    if (best && r->prefix_len <= best->prefix_len)
+      continue;
+    // Whole segments only: "api" matches "api" and "api/v1", not "apix"
+    if (r->prefix_len == 0 ||
+        (strncmp(path, r->prefix, r->prefix_len) == 0 &&
+         (path[r->prefix_len] == '/' || path[r->prefix_len] == '\0')))
+      best = r;
+  }
+  return best;
+}
+
+static int upstream_connect(const proxy_route_t *r) {
+  int fd = socket(r->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                  0);
+  if (fd < 0)
+    return -1;
+
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  if (connect(fd, (const struct sockaddr *)&r->addr, r->addr_len) < 0 &&
+      errno != EINPROGRESS) {
+    close(fd);
+    return -1;
+  }
+
+  struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+  int err = 0;
+  socklen_t len = sizeof(err);
+  if (poll(&pfd, 1, PROXY_CONNECT_MS) <= 0 ||
+      getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+    err = err ? err : ETIMEDOUT;
+    log_error("Cannot connect to upstream %s: %s", r->host, strerror(err));
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  return fd;
+}
+
+// A live idle connection has nothing to read. EOF or stray bytes mean
+// the upstream closed it or broke framing; either way it is unusable.
+static bool upstream_alive(int fd) {
+  char c;
+  ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+// Most recently used first: it is the least likely to have hit the
+// upstream's idle timeout.
+static int idle_get(proxy_route_t *r) {
+  while (1) {
+    pthread_mutex_lock(&r->mutex);
+    int fd = r->idle_count > 0 ? r->idle[--r->idle_count] : -1;
+    pthread_mutex_unlock(&r->mutex);
+
+    if (fd < 0 || upstream_alive(fd))
+      return fd;
+    close(fd);
+  }
+}
+
+static void idle_put(proxy_route_t *r, int fd) {
+  pthread_mutex_lock(&r->mutex);
+  if (r->idle_count < PROXY_POOL_SIZE) {
+    r->idle[r->idle_count++] = fd;
+    fd = -1;
+  }
+  pthread_mutex_unlock(&r->mutex);
+
+  if (fd >= 0)
+    close(fd);
+}
+
+static bool is_hop_by_hop(const char *line) {
+  for (size_t i = 0; i < sizeof(hop_by_hop) / sizeof(hop_by_hop[0]); i++) {
+    if (strncasecmp(line, hop_by_hop[i], strlen(hop_by_hop[i])) == 0)
+      return true;
+  }
+  return false;
+}
+
+static void client_address(int fd, char *out, size_t len) {
+  struct sockaddr_storage addr;
+  socklen_t addr_len = sizeof(addr);
+  out[0] = '\0';
+  if (getpeername(fd, (struct sockaddr *)&addr, &addr_len) < 0)
+    return;
+
+  if (addr.ss_family == AF_INET)
+    inet_ntop(AF_INET, &((struct sockaddr_in *)&addr)->sin_addr, out, len);
+  else if (addr.ss_family == AF_INET6)
+    inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&addr)->sin6_addr, out, len);
+}
+
+// Request line (as HTTP/1.1) and end-to-end headers, with the client's
+// address appended to X-Forwarded-For. Returns 0 if it does not fit.
+static size_t build_request(int fd, const http_request_t *req, char *out,
+                            size_t cap) {
+  const char *p = req->raw;
+  const char *headers_end = req->raw + req->header_len;
+  const char *eol = strstr(p, "\r\n");
+  const char *version = memrchr(p, ' ', eol - p);
+  char addr[INET6_ADDRSTRLEN];
+  client_address(fd, addr, sizeof(addr));
+  bool forwarded = false;
+
+  int n = snprintf(out, cap, "%.*s HTTP/1.1\r\n", (int)(version - p), p);
+  size_t len = n;
+
+  for (p = eol + 2; p < headers_end; p = eol + 2) {
+    eol = strstr(p, "\r\n");
+    if (!eol || eol == p)
+      break;
+    if (is_hop_by_hop(p))
+      continue;
+
+    if (strncasecmp(p, "X-Forwarded-For:", 16) == 0) {
+      n = snprintf(out + len, cap - len, "%.*s, %s\r\n", (int)(eol - p), p,
+                   addr);
+      forwarded = true;
+    } else {
+      n = snprintf(out + len, cap - len, "%.*s\r\n", (int)(eol - p), p);
+    }
+    if ((size_t)n >= cap - len)
+      return 0;
+    len += n;
+  }
+
+  n = forwarded ? snprintf(out + len, cap - len, "\r\n")
+                : snprintf(out + len, cap - len,
+                           "X-Forwarded-For: %s\r\n\r\n", addr);
+  if ((size_t)n >= cap - len)
+    return 0;
+  return len + n;
+}
+
+static bool send_request(int up, int fd, const http_request_t *req,
+                         const char *head, size_t head_len) {
+  size_t body = req->content_length > 0 ? (size_t)req->content_length : 0;
+  size_t have = req->raw_len - req->header_len;
+  if (have > body)
+    have = body;
+
+  ssize_t sent = body > 0 ? io_send_more(up, head, head_len)
+                          : io_send_buffer(up, head, head_len);
+  if (sent != (ssize_t)head_len)
+    return false;
+
+  if (have > 0) {
+    const char *p = req->raw + req->header_len;
+    sent = body > have ? io_send_more(up, p, have)
+                       : io_send_buffer(up, p, have);
+    if (sent != (ssize_t)have)
+      return false;
+  }
+
+  // The rest of the body goes from the client socket straight upstream
+  size_t rest = body - have;
+  return rest == 0 || io_splice(up, fd, rest) == (ssize_t)rest;
+}
+
+static bool upstream_fill(upstream_t *u) {
+  if (u->start > 0) {
+    memmove(u->buf, u->buf + u->start, u->end - u->start);
+    u->end -= u->start;
+    u->start = 0;
+  }
+  if (u->end == sizeof(u->buf))
+    return false;
+
+  while (1) {
+    ssize_t n = recv(u->fd, u->buf + u->end, sizeof(u->buf) - u->end, 0);
+    if (n > 0) {
+      u->end += n;
+      return true;
+    }
+    if (n == 0)
+      return false;
+    if (errno == EINTR)
+      continue;
+    if (errno != EAGAIN)
+      return false;
+
+    struct pollfd pfd = {.fd = u->fd, .events = POLLIN};
+    int ready = poll(&pfd, 1, PROXY_TIMEOUT_MS);
+    if (ready == 0) {
+      errno = ETIMEDOUT;
+      return false;
+    }
+    if (ready < 0 && errno != EINTR)
+      return false;
+  }
+}
+
+// Forward the next line, CRLF included. A NUL-terminated (possibly
+// truncated) copy without the CRLF is left in line.
+static bool relay_line(int fd, upstream_t *u, char *line, size_t cap,
+                       bool more) {
+  char *eol;
+  while (!(eol = memmem(u->buf + u->start, u->end - u->start, "\r\n", 2))) {
+    if (!upstream_fill(u))
+      return false;
+  }
+
+  size_t len = eol + 2 - (u->buf + u->start);
+  snprintf(line, cap, "%.*s", (int)(len - 2), u->buf + u->start);
+  ssize_t sent = more ? io_send_more(fd, u->buf + u->start, len)
+                      : io_send_buffer(fd, u->buf + u->start, len);
+  u->start += len;
+  return sent == (ssize_t)len;
+}
+
+// Whatever is already buffered goes out first; the rest is spliced.
+static bool relay_bytes(int fd, upstream_t *u, size_t count) {
+  size_t have = u->end - u->start;
+  if (have > count)
+    have = count;
+
+  if (have > 0) {
+    ssize_t sent = have < count ? io_send_more(fd, u->buf + u->start, have)
+                                : io_send_buffer(fd, u->buf + u->start, have);
+    if (sent != (ssize_t)have)
+      return false;
+    u->start += have;
+    count -= have;
+  }
+
+  return count == 0 || io_splice(fd, u->fd, count) == (ssize_t)count;
+}
+
+// Chunk-size lines are read to find the end of the message; chunk data
+// is spliced. The client gets the chunked encoding unchanged.
+static bool relay_chunked(int fd, upstream_t *u) {
+  char line[64];
+
+  while (1) {
+    if (!relay_line(fd, u, line, sizeof(line), true))
+      return false;
+    char *end;
+    unsigned long long size = strtoull(line, &end, 16);
+    if (end == line)
+      return false;
+    if (size == 0)
+      break;
+    if (!relay_bytes(fd, u, size + 2)) // Data and its CRLF
+      return false;
+  }
+
+  // Trailer fields, then the blank line that ends the message
+  do {
+    if (!relay_line(fd, u, line, sizeof(line), false))
+      return false;
+  } while (line[0] != '\0');
+  return true;
+}
+
+typedef struct {
+  int status;
+  body_t body;
+  size_t length;
+  bool reusable; // Upstream keeps the connection open afterwards
+} reply_t;
+
+// Parse the upstream head in u->buf[start, head_end) and render the one
+// sent to the client into out.
+static size_t rewrite_response(const http_request_t *req, const upstream_t *u,
+                               size_t head_end, reply_t *resp, char *out,
+                               size_t cap) {
+  const char *p = u->buf + u->start;
+  const char *end = u->buf + head_end;
+  const char *eol = memmem(p, end - p, "\r\n", 2);
+
+  // "HTTP/1.x NNN", the reason phrase is optional
+  resp->status = 0;
+  if (eol - p < 12 || strncmp(p, "HTTP/1.", 7) != 0)
+    return 0;
+  resp->status = atoi(p + 9);
+  resp->reusable = strncmp(p, "HTTP/1.1", 8) == 0;
+  resp->body = BODY_UNTIL_CLOSE;
+  resp->length = 0;
+  bool has_length = false;
+  bool chunked = false;
+
+  size_t len = 0;
+  int n = snprintf(out, cap, "%.*s\r\n", (int)(eol - p), p);
+  len = n;
+
+  for (p = eol + 2; p < end; p = eol + 2) {
+    eol = memmem(p, end - p, "\r\n", 2);
+    if (!eol || eol == p)
+      break;
+
+    if (strncasecmp(p, "Connection:", 11) == 0) {
+      if (memmem(p, eol - p, "close", 5))
+        resp->reusable = false;
+      else if (memmem(p, eol - p, "keep-alive", 10))
+        resp->reusable = true;
+    } else if (strncasecmp(p, "Content-Length:", 15) == 0) {
+      resp->length = strtoull(p + 15, NULL, 10);
+      has_length = true;
+    } else if (strncasecmp(p, "Transfer-Encoding:", 18) == 0) {
+      chunked = memmem(p, eol - p, "chunked", 7) != NULL;
+    }
+
+    if (is_hop_by_hop(p))
+      continue;
+    n = snprintf(out + len, cap - len, "%.*s\r\n", (int)(eol - p), p);
+    if ((size_t)n >= cap - len)
+      return 0;
+    len += n;
+  }
+
+  bool head = strcmp(req->method, "HEAD") == 0;
+  if (head || resp->status / 100 == 1 || resp->status == 204 ||
+      resp->status == 304)
+    resp->body = BODY_NONE;
+  else if (chunked)
+    resp->body = BODY_CHUNKED;
+  else if (has_length)
+    resp->body = BODY_LENGTH;
+
+  // Without a length the body ends when the upstream closes, and the
+  // client can only tell by us closing too.
+  bool keep = req->keep_alive && resp->body != BODY_UNTIL_CLOSE;
+  n = snprintf(out + len, cap - len, "Connection: %s\r\n\r\n",
+               keep ? "keep-alive" : "close");
+  if ((size_t)n >= cap - len)
+    return 0;
+  return len + n;
+}
+
+// Returns the status relayed, or 0 if the upstream failed before any of
+// its response reached the client. Consumes up.
+static int relay(int fd, http_request_t *req, proxy_route_t *route, int up,
+                 const char *head, size_t head_len) {
+  upstream_t u = {.fd = up};
+  reply_t resp;
+  char out[BUFFER_SIZE + 64];
+
+  if (!send_request(up, fd, req, head, head_len)) {
+    upstream_close(up);
+    return 0;
+  }
+
+  // Interim 1xx responses are relayed as they come
+  do {
+    char *head_end;
+    while (!(head_end = memmem(u.buf + u.start, u.end - u.start,
+                               "\r\n\r\n", 4))) {
+      if (!upstream_fill(&u)) {
+        upstream_close(up);
+        return 0;
+      }
+    }
+
+    size_t end = head_end + 4 - u.buf;
+    size_t len = rewrite_response(req, &u, end, &resp, out, sizeof(out));
+    if (len == 0 || resp.status < 100) {
+      upstream_close(up);
+      errno = EPROTO;
+      return 0;
+    }
+    u.start = end;
+
+    trace_stage(TRACE_SEND_START);
+    ssize_t sent = resp.body != BODY_NONE ? io_send_more(fd, out, len)
+                                          : io_send_buffer(fd, out, len);
+    if (sent != (ssize_t)len) {
+      req->keep_alive = false;
+      upstream_close(up);
+      return resp.status;
+    }
+  } while (resp.status / 100 == 1);
+
+  bool ok = true;
+  switch (resp.body) {
+  case BODY_NONE:
+    break;
+  case BODY_LENGTH:
+    ok = relay_bytes(fd, &u, resp.length);
+    break;
+  case BODY_CHUNKED:
+    ok = relay_chunked(fd, &u);
+    break;
+  case BODY_UNTIL_CLOSE:
+    ok = relay_bytes(fd, &u, u.end - u.start) &&
+         io_splice(fd, up, SIZE_MAX) >= 0;
+    req->keep_alive = false;
+    resp.reusable = false;
+    break;
+  }
+  trace_stage(TRACE_SEND_DONE);
+
+  if (!ok)
+    req->keep_alive = false;
+  if (ok && resp.reusable && u.start == u.end) {
+    publish(-1);
+    idle_put(route, up);
+  } else {
+    upstream_close(up);
+  }
+  return resp.status;
+}
+
+// Safe to send twice: the upstream may have acted on the first copy.
+static bool idempotent(const char *method) {
+  return strcmp(method, "GET") == 0 || strcmp(method, "HEAD") == 0 ||
+         strcmp(method, "OPTIONS") == 0;
+}
+
+int proxy_forward(int fd, http_request_t *req, proxy_route_t *route) {
+  // Only Content-Length request bodies can be delimited and forwarded
+  if (req->chunked) {
+    req->keep_alive = false;
+    http_send_response(fd, req, 411, response_reason(411));
+    return 411;
+  }
+
+  char head[BUFFER_SIZE + 128];
+  size_t head_len = build_request(fd, req, head, sizeof(head));
+  if (head_len == 0) {
+    req->keep_alive = false;
+    http_send_response(fd, req, 502, response_reason(502));
+    return 502;
+  }
+
+  // A pooled connection can die between the liveness check and our
+  // request; retry an idempotent request once on a freshly dialed one
+  // when nothing was consumed yet.
+  for (int attempt = 0; attempt < 2; attempt++) {
+    int up = attempt == 0 ? idle_get(route) : -1;
+    bool pooled = up >= 0;
+    if (!pooled)
+      up = upstream_connect(route);
+    if (up < 0)
+      break;
+    trace_stage(TRACE_OPENED);
+    publish(up);
+
+    int status = relay(fd, req, route, up, head, head_len);
+    if (status > 0)
+      return status;
+    if (!pooled || req->content_length > 0 || !idempotent(req->method) ||
+        errno == ETIMEDOUT)
+      break;
+  }
+
+  int status = errno == ETIMEDOUT ? 504 : 502;
+  if (req->content_length > 0)
+    req->keep_alive = false; // Body may be half read
+  http_send_response(fd, req, status, response_reason(status));
+  return status;
+}
@@ -0,0 +1,40 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include "config.h"
+#include "http.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+
+// A path prefix served by an upstream HTTP/1.1 server, and the idle
+// keep-alive connections kept open to it.
+typedef struct {
+  char prefix[256]; // Normalized like request paths, "" for everything
+  size_t prefix_len;
+  char host[256];
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  pthread_mutex_t mutex;
+  int idle[PROXY_POOL_SIZE]; // Most recently used last
+  size_t idle_count;
+} proxy_route_t;
+
+// Parse "/prefix=host:port" and resolve host. Call before serving.
+bool proxy_add_route(const char *spec);
+void proxy_cleanup(void);
+
+// Longest route prefix matching a path_normalize()d path, or NULL.
+proxy_route_t *proxy_match(const char *path);
+
+// Where the calling thread publishes the upstream fd it is relaying, so
+// pool_shutdown() can shut it down and unblock the thread.
+void proxy_thread_init(_Atomic int *upstream_fd);
+
+// Relay req to the route's upstream and the response back. Returns the
+// status sent to the client, and clears req->keep_alive when the client
+// connection cannot carry another request.
+int proxy_forward(int fd, http_request_t *req, proxy_route_t *route);
+
+#endif
@@ -11,6 +11,9 @@ typedef struct {
   uint64_t enqueue_time; // For adaptive pool metrics
   bool keep_alive;       // Connection persistence flag
   int timeout_ms;        // Keep-alive timeout
+  int cpu;               // SO_INCOMING_CPU when steering, else -1
+  uint64_t accept_ticks; // trace_now() at accept
+  int requests;          // Served so far, across bulk-lane hand-offs
 } job_t;
 
 // typedef struct {
@@ -0,0 +1,224 @@
+#include "response.h"
+#include "io.h"
+#include "mime_hash.h"
+#include "utils.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+typedef struct {
+  const char *ext;
+  size_t ext_len;
+  response_mime_t mime;
+} mime_entry_t;
+
+#include "mime_table.h"
+
+#define TYPE_DEFAULT "application/octet-stream"
+
+static const response_mime_t octet_stream = {
+    TYPE_DEFAULT, sizeof(TYPE_DEFAULT) - 1,
+    "Content-Type: " TYPE_DEFAULT "\r\n",
+    sizeof("Content-Type: " TYPE_DEFAULT "\r\n") - 1};
+
+typedef struct {
+  int code;
+  const char *reason;
+  const char *line;
+  size_t line_len;
+} status_t;
+
+#define STATUS(code, reason)                                                 \
+  {code, reason, "HTTP/1.1 " #code " " reason "\r\n",                        \
+   sizeof("HTTP/1.1 " #code " " reason "\r\n") - 1}
+
+// The last entry doubles as the fallback for unknown codes.
+static const status_t statuses[] = {
+    STATUS(200, "OK"),
+    STATUS(304, "Not Modified"),
+    STATUS(403, "Forbidden"),
+    STATUS(404, "Not Found"),
+    STATUS(405, "Method Not Allowed"),
+    STATUS(408, "Request Timeout"),
+    STATUS(411, "Length Required"),
+    STATUS(421, "Misdirected Request"),
+    STATUS(431, "Request Header Fields Too Large"),
+    STATUS(502, "Bad Gateway"),
+    STATUS(504, "Gateway Timeout"),
+    STATUS(500, "Internal Server Error"),
+};
+
+#define STATUS_COUNT (sizeof(statuses) / sizeof(statuses[0]))
+
+static const char conn_keep_alive[] = "Connection: keep-alive\r\n\r\n";
+static const char conn_close[] = "Connection: close\r\n\r\n";
+
+// Two rendered Server+Date heads. The timer fills the one readers are not
+// using and then publishes it, so a reader's memcpy never races a write
+// unless it stalls for a whole second.
+static char heads[2][RESPONSE_HEAD_LEN];
+static _Atomic int head_index = -1;
+
+static pthread_t date_thread;
+static pthread_mutex_t date_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t date_cond = PTHREAD_COND_INITIALIZER;
+static bool date_stop;
+static bool date_running;
+
+static void date_render(void) {
+  static const char server[] = RESPONSE_SERVER_LINE "Date: ";
+
+  int next = atomic_load_explicit(&head_index, memory_order_relaxed) == 0;
+  char *p = heads[next];
+  memcpy(p, server, sizeof(server) - 1);
+  p += sizeof(server) - 1;
+
+  time_t now = time(NULL);
+  struct tm tm;
+  gmtime_r(&now, &tm);
+  strftime(p, RESPONSE_DATE_LEN + 1, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  memcpy(p + RESPONSE_DATE_LEN, "\r\n", 2);
+
+  atomic_store_explicit(&head_index, next, memory_order_release);
+}
+
+// Wakes on each wall-clock second boundary so Date ticks with the clock.
+static void *date_timer(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&date_mutex);
+  while (!date_stop) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    struct timespec next = {.tv_sec = now.tv_sec + 1};
+    pthread_cond_timedwait(&date_cond, &date_mutex, &next);
+    if (!date_stop)
+      date_render();
+  }
+  pthread_mutex_unlock(&date_mutex);
+  return NULL;
+}
+
+bool response_init(void) {
+  date_render();
+  date_stop = false;
+  if (pthread_create(&date_thread, NULL, date_timer, NULL) != 0) {
+    log_error("Failed to start Date timer");
+    return false;
+  }
+  date_running = true;
+  return true;
+}
+
+void response_cleanup(void) {
+  if (!date_running)
+    return;
+
+  pthread_mutex_lock(&date_mutex);
+  date_stop = true;
+  pthread_cond_signal(&date_cond);
+  pthread_mutex_unlock(&date_mutex);
+  pthread_join(date_thread, NULL);
+  date_running = false;
+}
+
+const response_mime_t *response_mime(const char *path) {
+  const char *dot = strrchr(path, '.');
+  if (!dot || strchr(dot, '/'))
+    return &octet_stream;
+
+  const char *ext = dot + 1;
+  size_t len = strlen(ext);
+  if (len == 0 || len > MIME_EXT_MAX)
+    return &octet_stream;
+
+  uint32_t seed = mime_seeds[mime_hash(ext, len, 0) & (MIME_BUCKETS - 1)];
+  const mime_entry_t *e =
+      &mime_table[mime_hash(ext, len, seed) & (MIME_TABLE_SIZE - 1)];
+  if (e->ext_len != len || strncasecmp(e->ext, ext, len) != 0)
+    return &octet_stream;
+  return &e->mime;
+}
+
+static const status_t *status_find(int status) {
+  for (size_t i = 0; i < STATUS_COUNT - 1; i++)
+    if (statuses[i].code == status)
+      return &statuses[i];
+  return &statuses[STATUS_COUNT - 1];
+}
+
+const char *response_reason(int status) {
+  return status_find(status)->reason;
+}
+
+bool response_date(char *out) {
+  static const size_t offset = sizeof(RESPONSE_SERVER_LINE "Date: ") - 1;
+
+  int i = atomic_load_explicit(&head_index, memory_order_acquire);
+  if (i < 0)
+    return false;
+  memcpy(out, heads[i] + offset, RESPONSE_DATE_LEN);
+  return true;
+}
+
+bool response_add(response_t *r, const void *data, size_t len) {
+  if (r->count == RESPONSE_IOV_MAX) {
+    if (!r->overflow)
+      log_error("Response needs more than %d iovecs", RESPONSE_IOV_MAX);
+    r->overflow = true;
+    return false;
+  }
+  r->iov[r->count++] = (struct iovec){.iov_base = (void *)data,
+                                      .iov_len = len};
+  return true;
+}
+
+void response_begin(response_t *r, int status) {
+  const status_t *s = status_find(status);
+  r->count = 0;
+  r->overflow = false;
+  response_add(r, s->line, s->line_len);
+
+  int i = atomic_load_explicit(&head_index, memory_order_acquire);
+  if (i < 0) {
+    response_add(r, RESPONSE_SERVER_LINE, sizeof(RESPONSE_SERVER_LINE) - 1);
+    return;
+  }
+  memcpy(r->head, heads[i], RESPONSE_HEAD_LEN);
+  response_add(r, r->head, RESPONSE_HEAD_LEN);
+}
+
+char *response_u64(char *end, uint64_t v) {
+  do {
+    *--end = (char)('0' + v % 10);
+    v /= 10;
+  } while (v);
+  return end;
+}
+
+void response_content_length(response_t *r, uint64_t length) {
+  static const char name[] = "Content-Length: ";
+
+  char *end = r->length + sizeof(r->length) - 2;
+  memcpy(end, "\r\n", 2);
+  char *p = response_u64(end, length) - (sizeof(name) - 1);
+  memcpy(p, name, sizeof(name) - 1);
+  response_add(r, p, r->length + sizeof(r->length) - p);
+}
+
+void response_end(response_t *r, bool keep_alive) {
+  if (keep_alive)
+    response_add(r, conn_keep_alive, sizeof(conn_keep_alive) - 1);
+  else
+    response_add(r, conn_close, sizeof(conn_close) - 1);
+}
+
+ssize_t response_send(int fd, response_t *r, bool more) {
+  if (r->overflow) {
+    errno = EOVERFLOW;
+    return -1;
+  }
+  return io_send_iov(fd, r->iov, r->count, more);
+}
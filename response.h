@@ -0,0 +1,63 @@
+#ifndef RESPONSE_H
+#define RESPONSE_H
+
+#include "config.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// HTTP/1.1 response heads assembled as iovecs over pre-rendered
+// fragments. Nothing on this path formats text: status lines are static,
+// Content-Type comes from a generated table, Server and Date from a line
+// a timer thread re-renders once a second.
+
+#define RESPONSE_IOV_MAX 8
+#define RESPONSE_DATE_LEN 29 // "Sun, 06 Nov 1994 08:49:37 GMT"
+#define RESPONSE_SERVER_LINE "Server: " SERVER_NAME "\r\n"
+#define RESPONSE_HEAD_LEN                                                    \
+  (sizeof(RESPONSE_SERVER_LINE "Date: \r\n") - 1 + RESPONSE_DATE_LEN)
+
+typedef struct {
+  const char *type;
+  size_t type_len;
+  const char *header; // "Content-Type: <type>\r\n"
+  size_t header_len;
+} response_mime_t;
+
+typedef struct {
+  struct iovec iov[RESPONSE_IOV_MAX];
+  int count;
+  bool overflow; // An add did not fit; response_send() refuses to send
+  char head[RESPONSE_HEAD_LEN]; // Snapshot of the Server and Date lines
+  char length[40];              // "Content-Length: <n>\r\n", right-aligned
+} response_t;
+
+// Start the Date timer. Responses built before this carry no Date.
+bool response_init(void);
+void response_cleanup(void);
+
+// Type for a path by extension; application/octet-stream if unknown.
+const response_mime_t *response_mime(const char *path);
+const char *response_reason(int status);
+
+// Current Date value, RESPONSE_DATE_LEN bytes, not NUL-terminated.
+// False before response_init().
+bool response_date(char *out);
+
+// Write v's digits so they end just before end; returns the first.
+char *response_u64(char *end, uint64_t v);
+
+// Status line plus Server and Date.
+void response_begin(response_t *r, int status);
+// Append bytes that must stay valid until the response is sent. False,
+// with an error logged, if RESPONSE_IOV_MAX is exceeded.
+bool response_add(response_t *r, const void *data, size_t len);
+void response_content_length(response_t *r, uint64_t length);
+// Connection header and the blank line that ends the head.
+void response_end(response_t *r, bool keep_alive);
+// -1 with errno EOVERFLOW if any add failed.
+ssize_t response_send(int fd, response_t *r, bool more);
+
+#endif
@@ -12,7 +12,7 @@
 #include <unistd.h>
 
 int server_create(int port) {
-  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
   if (fd < 0) {
     log_error("socket: %s", strerror(errno));
     return -1;
@@ -25,11 +25,6 @@ int server_create(int port) {
     return -1;
   }
 
-  if (setsockopt(fd, IPPROTO_TCP, TCP_CORK, &opt, sizeof(opt)) < 0) {
-    log_error("setsockopt TCP_CORK: %s", strerror(errno));
-    // Non-fatal
-  }
-
   struct sockaddr_in addr = {.sin_family = AF_INET,
                              .sin_addr.s_addr = INADDR_ANY,
                              .sin_port = htons(port)};
@@ -52,7 +47,9 @@ int server_create(int port) {
 
 int server_accept(int server_fd, struct sockaddr_in *client_addr) {
   socklen_t addr_len = sizeof(*client_addr);
-  int fd = accept(server_fd, (struct sockaddr *)client_addr, &addr_len);
+  // CLOEXEC keeps client sockets out of a re-exec'd binary on upgrade
+  int fd = accept4(server_fd, (struct sockaddr *)client_addr, &addr_len,
+                   SOCK_NONBLOCK | SOCK_CLOEXEC);
 
   if (fd < 0) {
     if (errno != EINTR && errno != EAGAIN) {
@@ -61,13 +58,8 @@ int server_accept(int server_fd, struct sockaddr_in *client_addr) {
     return -1;
   }
 
-  // Set non-blocking
-  int flags = fcntl(fd, F_GETFL, 0);
-  fcntl(fd, F_SETFL, flags | O_NONBLOCK);
-
-  // Set TCP_CORK on client socket (not server socket)
-  int opt = 1;
-  setsockopt(fd, IPPROTO_TCP, TCP_CORK, &opt, sizeof(opt));
+  // No TCP_CORK: a corked socket holds the tail of every response for up
+  // to 200ms. Header writes that precede a body use MSG_MORE instead.
 
   return fd;
 }
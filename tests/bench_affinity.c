@@ -0,0 +1,199 @@
+// Throughput of the full accept -> queue -> worker -> sendfile path over
+// loopback, with workers floating, pinned (-c), and pinned + steered (-s).
+// Run from the repository root so ./www is the document root.
+
+#include "../affinity.h"
+#include "../config.h"
+#include "../path.h"
+#include "../queue.h"
+#include "../response.h"
+#include "../server.h"
+#include "../thread_pool.h"
+#include "../utils.h"
+#include <arpa/inet.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define CLIENTS 32
+#define REQUESTS_PER_CLIENT 2000
+#define REQUEST "GET /index.html HTTP/1.1\r\nHost: bench\r\n\r\n"
+
+typedef struct {
+  int listen_fd;
+  thread_pool_t *pool;
+  const affinity_t *aff;
+  _Atomic bool stop;
+} acceptor_t;
+
+static int bench_port;
+
+static void *acceptor_thread(void *arg) {
+  acceptor_t *a = arg;
+
+  while (!atomic_load(&a->stop)) {
+    struct pollfd pfd = {.fd = a->listen_fd, .events = POLLIN};
+    if (poll(&pfd, 1, 50) <= 0)
+      continue;
+
+    struct sockaddr_in addr;
+    int fd = server_accept(a->listen_fd, &addr);
+    if (fd < 0)
+      continue;
+
+    job_t job = {.client_fd = fd,
+                 .enqueue_time = time_ms(),
+                 .keep_alive = true,
+                 .timeout_ms = KEEPALIVE_TIMEOUT_MS,
+                 .cpu = a->aff->steer ? affinity_incoming_cpu(fd) : -1};
+    pool_submit(a->pool, job);
+  }
+
+  return NULL;
+}
+
+// One keep-alive connection per client, reconnecting when the server hits
+// KEEPALIVE_MAX_REQ.
+static void *client_thread(void *arg) {
+  size_t *done = arg;
+  int fd = -1;
+  char buf[BUFFER_SIZE];
+
+  for (int i = 0; i < REQUESTS_PER_CLIENT; i++) {
+    if (fd < 0) {
+      fd = socket(AF_INET, SOCK_STREAM, 0);
+      struct sockaddr_in addr = {.sin_family = AF_INET,
+                                 .sin_port = htons(bench_port),
+                                 .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+      if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        fd = -1;
+        continue;
+      }
+    }
+
+    if (write(fd, REQUEST, sizeof(REQUEST) - 1) < 0) {
+      close(fd);
+      fd = -1;
+      continue;
+    }
+
+    // Read one full response: headers, then Content-Length bytes
+    size_t have = 0;
+    long body = -1;
+    char *hdr_end = NULL;
+    while (1) {
+      ssize_t n = read(fd, buf + have, sizeof(buf) - 1 - have);
+      if (n <= 0)
+        break;
+      have += n;
+      buf[have] = '\0';
+      if (!hdr_end && (hdr_end = strstr(buf, "\r\n\r\n"))) {
+        char *cl = strcasestr(buf, "Content-Length:");
+        body = cl ? atol(cl + 15) : 0;
+      }
+      if (hdr_end && (long)(have - (hdr_end + 4 - buf)) >= body)
+        break;
+    }
+
+    if (!hdr_end) {
+      close(fd);
+      fd = -1;
+      continue;
+    }
+
+    (*done)++;
+    if ((i + 1) % KEEPALIVE_MAX_REQ == 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+
+  if (fd >= 0)
+    close(fd);
+  return NULL;
+}
+
+static double run(const char *label, const affinity_t *aff, size_t workers) {
+  queue_t queue;
+  thread_pool_t pool;
+  queue_init(&queue, QUEUE_CAPACITY);
+  pool_init(&pool, &queue, workers, workers, aff);
+
+  acceptor_t a = {.listen_fd = server_create(bench_port),
+                  .pool = &pool,
+                  .aff = aff};
+  atomic_init(&a.stop, false);
+  pthread_t acceptor;
+  pthread_create(&acceptor, NULL, acceptor_thread, &a);
+
+  pthread_t clients[CLIENTS];
+  size_t done[CLIENTS] = {0};
+  uint64_t start = time_ms();
+  for (int i = 0; i < CLIENTS; i++)
+    pthread_create(&clients[i], NULL, client_thread, &done[i]);
+
+  size_t total = 0;
+  for (int i = 0; i < CLIENTS; i++) {
+    pthread_join(clients[i], NULL);
+    total += done[i];
+  }
+  uint64_t elapsed = time_ms() - start;
+
+  atomic_store(&a.stop, true);
+  pthread_join(acceptor, NULL);
+  close(a.listen_fd);
+  pool_drain(&pool, 5000);
+  pool_shutdown(&pool);
+  queue_destroy(&queue);
+
+  double rps = elapsed ? total * 1000.0 / elapsed : 0;
+  printf("%-16s %8zu requests in %6lums  %10.0f req/s\n", label, total,
+         (unsigned long)elapsed, rps);
+  return rps;
+}
+
+int main(void) {
+  if (!path_init("www")) {
+    fprintf(stderr, "Run from the repository root (needs ./www)\n");
+    return 1;
+  }
+  if (!response_init())
+    return 1;
+
+  bench_port = 18000 + getpid() % 1000;
+  size_t cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t workers = cpus < 4 ? 4 : cpus;
+
+  affinity_t floating;
+  affinity_init(&floating);
+
+  affinity_t pinned;
+  affinity_init(&pinned);
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &pinned.set))
+      pinned.cpus[pinned.count++] = cpu;
+  }
+
+  affinity_t steered = pinned;
+  steered.steer = true;
+
+  printf("%zu CPUs, %zu workers, %d clients x %d requests\n", pinned.count,
+         workers, CLIENTS, REQUESTS_PER_CLIENT);
+
+  double base = run("unpinned", &floating, workers);
+  double pin = run("pinned", &pinned, workers);
+  double steer = run("pinned+steered", &steered, workers);
+
+  if (base > 0)
+    printf("pinned: %+.1f%%  pinned+steered: %+.1f%%\n",
+           (pin / base - 1) * 100, (steer / base - 1) * 100);
+
+  path_cleanup();
+  return 0;
+}
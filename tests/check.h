@@ -0,0 +1,26 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+// Minimal assertions for the tests/ programs: a failed CHECK reports and
+// counts, and the test carries on so one run shows every failure.
+
+#include <stdio.h>
+
+static int failures;
+
+#define CHECK(cond)                                                          \
+  do {                                                                       \
+    if (!(cond)) {                                                           \
+      fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__,      \
+              #cond);                                                        \
+      failures++;                                                            \
+    }                                                                        \
+  } while (0)
+
+// Prints the verdict; returns the exit status for main().
+static inline int check_result(const char *name) {
+  printf("%s: %s\n", name, failures ? "FAILED" : "ok");
+  return failures != 0;
+}
+
+#endif
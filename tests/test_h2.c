@@ -0,0 +1,319 @@
+// h2_serve() over a socketpair, driven frame by frame: bad frame lengths,
+// CONTINUATION interleaving, flow-control window overflow and stream ids
+// that go backwards.
+
+#include "../config.h"
+#include "../h2.h"
+#include "../hpack.h"
+#include "../path.h"
+#include "check.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+
+enum { DATA, HEADERS, PRIORITY, RST_STREAM, SETTINGS, PUSH_PROMISE, PING,
+       GOAWAY, WINDOW_UPDATE, CONTINUATION };
+
+enum { NO_ERROR, PROTOCOL_ERROR, INTERNAL_ERROR, FLOW_CONTROL_ERROR,
+       SETTINGS_TIMEOUT, STREAM_CLOSED, FRAME_SIZE_ERROR };
+
+#define END_STREAM 0x1
+#define END_HEADERS 0x4
+
+typedef struct {
+  int fd; // Client end
+  pthread_t thread;
+  hpack_table_t encoder;
+} peer_t;
+
+// What the server sent back before closing or going quiet.
+typedef struct {
+  int goaway; // Error code, or -1
+  int rst;    // Error code of the last RST_STREAM, or -1
+  int responses; // HEADERS frames
+} outcome_t;
+
+static void *serve(void *arg) {
+  int fd = (int)(intptr_t)arg;
+  h2_serve(fd);
+  close(fd);
+  return NULL;
+}
+
+static void send_all(int fd, const void *buf, size_t len) {
+  const char *p = buf;
+  while (len > 0) {
+    ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+    if (n <= 0)
+      return;
+    p += n;
+    len -= n;
+  }
+}
+
+static void send_frame(peer_t *p, uint8_t type, uint8_t flags,
+                       uint32_t stream, const void *payload, size_t len) {
+  uint8_t h[9] = {len >> 16, len >> 8, len, type, flags,
+                  stream >> 24, stream >> 16, stream >> 8, stream};
+  send_all(p->fd, h, sizeof(h));
+  send_all(p->fd, payload, len);
+}
+
+static void send_u32(peer_t *p, uint8_t type, uint32_t stream, uint32_t v) {
+  uint8_t b[4] = {v >> 24, v >> 16, v >> 8, v};
+  send_frame(p, type, 0, stream, b, sizeof(b));
+}
+
+static void peer_open(peer_t *p) {
+  int sv[2];
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == 0);
+  fcntl(sv[1], F_SETFL, fcntl(sv[1], F_GETFL) | O_NONBLOCK);
+  p->fd = sv[0];
+  hpack_table_init(&p->encoder);
+  pthread_create(&p->thread, NULL, serve, (void *)(intptr_t)sv[1]);
+
+  send_all(p->fd, PREFACE, strlen(PREFACE));
+  send_frame(p, SETTINGS, 0, 0, NULL, 0);
+}
+
+// A GET header block for path.
+static size_t request_block(peer_t *p, const char *path, uint8_t *out,
+                            size_t cap) {
+  static const char *names[] = {":method", ":scheme", ":path", ":authority"};
+  const char *values[] = {"GET", "http", path, "localhost"};
+  size_t len = hpack_encode_begin(&p->encoder, out, cap);
+  for (size_t i = 0; i < 4; i++)
+    len += hpack_encode(&p->encoder, out + len, cap - len, names[i],
+                        values[i], strlen(values[i]), true);
+  return len;
+}
+
+static void send_request(peer_t *p, uint32_t stream, const char *path) {
+  uint8_t block[256];
+  size_t len = request_block(p, path, block, sizeof(block));
+  send_frame(p, HEADERS, END_STREAM | END_HEADERS, stream, block, len);
+}
+
+static bool recv_full(int fd, uint8_t *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = recv(fd, buf, len, 0);
+    if (n <= 0)
+      return false;
+    buf += n;
+    len -= n;
+  }
+  return true;
+}
+
+// Read until GOAWAY, EOF or a quiet spell, then hang up and reap the
+// server.
+static outcome_t peer_close(peer_t *p) {
+  outcome_t o = {.goaway = -1, .rst = -1};
+  static uint8_t payload[1 << 24];
+
+  struct pollfd pfd = {.fd = p->fd, .events = POLLIN};
+  while (poll(&pfd, 1, 300) == 1) {
+    uint8_t h[9];
+    if (!recv_full(p->fd, h, sizeof(h)))
+      break;
+    size_t len = (size_t)h[0] << 16 | h[1] << 8 | h[2];
+    if (!recv_full(p->fd, payload, len))
+      break;
+    uint32_t code = len >= 4 ? (uint32_t)payload[len - 4] << 24 |
+                                   payload[len - 3] << 16 |
+                                   payload[len - 2] << 8 | payload[len - 1]
+                             : 0;
+    if (h[3] == GOAWAY) {
+      o.goaway = code;
+      break;
+    }
+    if (h[3] == RST_STREAM)
+      o.rst = code;
+    else if (h[3] == HEADERS)
+      o.responses++;
+  }
+
+  close(p->fd);
+  pthread_join(p->thread, NULL);
+  hpack_table_free(&p->encoder);
+  return o;
+}
+
+static void expect_goaway(peer_t *p, int code) {
+  outcome_t o = peer_close(p);
+  if (o.goaway != code)
+    fprintf(stderr, "GOAWAY %d, want %d\n", o.goaway, code);
+  CHECK(o.goaway == code);
+}
+
+static void test_lengths(void) {
+  peer_t p;
+  uint8_t zero[H2_FRAME_SIZE + 1] = {0};
+
+  peer_open(&p);
+  send_frame(&p, PING, 0, 0, zero, 7);
+  expect_goaway(&p, FRAME_SIZE_ERROR);
+
+  peer_open(&p);
+  send_frame(&p, SETTINGS, 0, 0, zero, 5);
+  expect_goaway(&p, FRAME_SIZE_ERROR);
+
+  peer_open(&p);
+  send_frame(&p, SETTINGS, 0x1, 0, zero, 6); // ACK with a payload
+  expect_goaway(&p, FRAME_SIZE_ERROR);
+
+  peer_open(&p);
+  send_frame(&p, WINDOW_UPDATE, 0, 0, zero, 3);
+  expect_goaway(&p, FRAME_SIZE_ERROR);
+
+  peer_open(&p);
+  send_frame(&p, RST_STREAM, 0, 1, zero, 3);
+  expect_goaway(&p, FRAME_SIZE_ERROR);
+
+  peer_open(&p);
+  send_frame(&p, DATA, 0, 1, zero, sizeof(zero));
+  expect_goaway(&p, FRAME_SIZE_ERROR);
+}
+
+static void test_continuation(void) {
+  peer_t p;
+  uint8_t block[256];
+  size_t len;
+
+  // Split across HEADERS and CONTINUATION: served normally
+  peer_open(&p);
+  len = request_block(&p, "/small", block, sizeof(block));
+  send_frame(&p, HEADERS, END_STREAM, 1, block, 3);
+  send_frame(&p, CONTINUATION, 0, 1, block + 3, 2);
+  send_frame(&p, CONTINUATION, END_HEADERS, 1, block + 5, len - 5);
+  outcome_t o = peer_close(&p);
+  CHECK(o.goaway == -1 && o.rst == -1 && o.responses == 1);
+
+  // Nothing may come between a HEADERS frame and its END_HEADERS
+  peer_open(&p);
+  len = request_block(&p, "/small", block, sizeof(block));
+  send_frame(&p, HEADERS, END_STREAM, 1, block, len);
+  send_frame(&p, PING, 0, 0, block, 8);
+  expect_goaway(&p, PROTOCOL_ERROR);
+
+  peer_open(&p);
+  len = request_block(&p, "/small", block, sizeof(block));
+  send_frame(&p, HEADERS, END_STREAM, 1, block, len);
+  send_request(&p, 3, "/small");
+  expect_goaway(&p, PROTOCOL_ERROR);
+
+  peer_open(&p);
+  len = request_block(&p, "/small", block, sizeof(block));
+  send_frame(&p, HEADERS, END_STREAM, 1, block, 3);
+  send_frame(&p, CONTINUATION, END_HEADERS, 3, block + 3, len - 3);
+  expect_goaway(&p, PROTOCOL_ERROR);
+
+  // CONTINUATION with no header block open
+  peer_open(&p);
+  send_frame(&p, CONTINUATION, END_HEADERS, 1, block, len);
+  expect_goaway(&p, PROTOCOL_ERROR);
+}
+
+static void test_windows(void) {
+  peer_t p;
+
+  peer_open(&p);
+  send_u32(&p, WINDOW_UPDATE, 0, 0x7fffffff);
+  expect_goaway(&p, FLOW_CONTROL_ERROR);
+
+  // /big outlasts the connection window, so its stream stays open
+  peer_open(&p);
+  send_request(&p, 1, "/big");
+  send_u32(&p, WINDOW_UPDATE, 1, 0x7fffffff);
+  outcome_t o = peer_close(&p);
+  CHECK(o.goaway == -1 && o.rst == FLOW_CONTROL_ERROR);
+
+  // A new initial window applies to open streams too, and must not push
+  // one past 2^31-1
+  peer_open(&p);
+  send_request(&p, 1, "/big");
+  send_u32(&p, WINDOW_UPDATE, 1, 1000000);
+  uint8_t setting[6] = {0, 4, 0x7f, 0xff, 0xff, 0xff};
+  send_frame(&p, SETTINGS, 0, 0, setting, sizeof(setting));
+  expect_goaway(&p, FLOW_CONTROL_ERROR);
+
+  // ...while one that fits is accepted
+  peer_open(&p);
+  send_request(&p, 1, "/big");
+  uint8_t fits[6] = {0, 4, 0, 1, 0, 0};
+  send_frame(&p, SETTINGS, 0, 0, fits, sizeof(fits));
+  o = peer_close(&p);
+  CHECK(o.goaway == -1 && o.responses == 1);
+}
+
+static void test_stream_ids(void) {
+  peer_t p;
+  uint8_t block[256];
+
+  // A new request may not reuse or go below an earlier stream id
+  peer_open(&p);
+  send_request(&p, 3, "/small");
+  send_request(&p, 1, "/small");
+  expect_goaway(&p, PROTOCOL_ERROR);
+
+  peer_open(&p);
+  send_request(&p, 1, "/small");
+  send_request(&p, 1, "/small");
+  expect_goaway(&p, PROTOCOL_ERROR);
+
+  // Trailers on an earlier stream are still let through
+  peer_open(&p);
+  send_request(&p, 1, "/small");
+  size_t len = hpack_encode_begin(&p.encoder, block, sizeof(block));
+  len += hpack_encode(&p.encoder, block + len, sizeof(block) - len,
+                      "x-checksum", "1", 1, false);
+  send_frame(&p, HEADERS, END_STREAM | END_HEADERS, 1, block, len);
+  outcome_t o = peer_close(&p);
+  CHECK(o.goaway == -1 && o.responses == 1);
+}
+
+static void write_file(const char *path, size_t size) {
+  FILE *f = fopen(path, "w");
+  CHECK(f != NULL);
+  if (!f)
+    return;
+  for (size_t i = 0; i < size; i++)
+    fputc('a' + i % 26, f);
+  fclose(f);
+}
+
+int main(void) {
+  char base[] = "/tmp/test_h2.XXXXXX";
+  if (!mkdtemp(base)) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/big", base);
+  write_file(path, 200 * 1024);
+  snprintf(path, sizeof(path), "%s/small", base);
+  write_file(path, 100);
+  CHECK(path_init(base));
+
+  test_lengths();
+  test_continuation();
+  test_windows();
+  test_stream_ids();
+
+  char cmd[PATH_MAX + 16];
+  snprintf(cmd, sizeof(cmd), "rm -rf %s", base);
+  if (system(cmd) != 0)
+    fprintf(stderr, "Could not remove %s\n", base);
+
+  return check_result("test_h2");
+}
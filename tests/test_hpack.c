@@ -0,0 +1,217 @@
+// hpack_decode() against the RFC 7541 Appendix C examples (literals,
+// indexing, Huffman strings, dynamic-table eviction), and hpack_encode()
+// reproducing the raw-literal ones byte for byte.
+
+#include "../hpack.h"
+#include "check.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_HEADERS 8
+
+typedef struct {
+  char lines[MAX_HEADERS][128]; // "name: value"
+  size_t count;
+} header_list_t;
+
+static void collect(void *ctx, const char *name, size_t name_len,
+                    const char *value, size_t value_len) {
+  header_list_t *l = ctx;
+  if (l->count < MAX_HEADERS)
+    snprintf(l->lines[l->count], sizeof(l->lines[0]), "%.*s: %.*s",
+             (int)name_len, name, (int)value_len, value);
+  l->count++;
+}
+
+static size_t unhex(const char *hex, uint8_t *out) {
+  size_t n = 0;
+  for (; hex[0] && hex[1]; hex += 2) {
+    unsigned byte;
+    sscanf(hex, "%2x", &byte);
+    out[n++] = (uint8_t)byte;
+  }
+  return n;
+}
+
+// Decode one block and compare the headers (NULL-terminated) and the
+// table size afterwards.
+static void expect_block(hpack_table_t *t, const char *hex,
+                         const char *const *want, size_t size) {
+  uint8_t block[256];
+  size_t len = unhex(hex, block);
+  header_list_t got = {0};
+
+  CHECK(hpack_decode(t, block, len, collect, &got) == 0);
+  size_t n = 0;
+  for (; want[n]; n++) {
+    if (n >= got.count || strcmp(got.lines[n], want[n]) != 0)
+      fprintf(stderr, "header %zu: got \"%s\", want \"%s\"\n", n,
+              n < got.count ? got.lines[n] : "", want[n]);
+    CHECK(n < got.count && strcmp(got.lines[n], want[n]) == 0);
+  }
+  CHECK(got.count == n);
+  if (t->size != size)
+    fprintf(stderr, "table size %zu, want %zu\n", t->size, size);
+  CHECK(t->size == size);
+}
+
+static const char *const c3_1[] = {":method: GET", ":scheme: http",
+                                   ":path: /", ":authority: www.example.com",
+                                   NULL};
+static const char *const c3_2[] = {
+    ":method: GET", ":scheme: http", ":path: /",
+    ":authority: www.example.com", "cache-control: no-cache", NULL};
+static const char *const c3_3[] = {
+    ":method: GET", ":scheme: https", ":path: /index.html",
+    ":authority: www.example.com", "custom-key: custom-value", NULL};
+
+static const char *const c5_1[] = {
+    ":status: 302", "cache-control: private",
+    "date: Mon, 21 Oct 2013 20:13:21 GMT",
+    "location: https://www.example.com", NULL};
+static const char *const c5_2[] = {
+    ":status: 307", "cache-control: private",
+    "date: Mon, 21 Oct 2013 20:13:21 GMT",
+    "location: https://www.example.com", NULL};
+static const char *const c5_3[] = {
+    ":status: 200",
+    "cache-control: private",
+    "date: Mon, 21 Oct 2013 20:13:22 GMT",
+    "location: https://www.example.com",
+    "content-encoding: gzip",
+    "set-cookie: foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1",
+    NULL};
+
+#define C3_1 "828684410f7777772e6578616d706c652e636f6d"
+#define C3_2 "828684be58086e6f2d6361636865"
+#define C3_3 "828785bf400a637573746f6d2d6b65790c637573746f6d2d76616c7565"
+
+#define C5_1                                                                 \
+  "4803333032580770726976617465611d4d6f6e2c203231204f63742032303133203230" \
+  "3a31333a323120474d546e1768747470733a2f2f7777772e6578616d706c652e636f6d"
+#define C5_2 "4803333037c1c0bf"
+#define C5_3                                                                 \
+  "88c1611d4d6f6e2c203231204f637420323031332032303a31333a323220474d54c05a" \
+  "04677a69707738666f6f3d4153444a4b48514b425a584f5157454f50495541585157454f" \
+  "49553b206d61782d6167653d333630303b2076657273696f6e3d31"
+
+static void test_decode(void) {
+  hpack_table_t t;
+
+  // C.2: one block each, against a fresh table
+  hpack_table_init(&t);
+  expect_block(&t, "400a637573746f6d2d6b65790d637573746f6d2d686561646572",
+               (const char *[]){"custom-key: custom-header", NULL}, 55);
+  CHECK(t.count == 1);
+  hpack_table_free(&t);
+
+  hpack_table_init(&t);
+  expect_block(&t, "040c2f73616d706c652f70617468",
+               (const char *[]){":path: /sample/path", NULL}, 0);
+  hpack_table_free(&t);
+
+  hpack_table_init(&t);
+  expect_block(&t, "100870617373776f726406736563726574",
+               (const char *[]){"password: secret", NULL}, 0);
+  hpack_table_free(&t);
+
+  hpack_table_init(&t);
+  expect_block(&t, "82", (const char *[]){":method: GET", NULL}, 0);
+  hpack_table_free(&t);
+
+  // C.3: three requests sharing a table
+  hpack_table_init(&t);
+  expect_block(&t, C3_1, c3_1, 57);
+  expect_block(&t, C3_2, c3_2, 110);
+  expect_block(&t, C3_3, c3_3, 164);
+  hpack_table_free(&t);
+
+  // C.4: the same requests with Huffman strings
+  hpack_table_init(&t);
+  expect_block(&t, "828684418cf1e3c2e5f23a6ba0ab90f4ff", c3_1, 57);
+  expect_block(&t, "828684be5886a8eb10649cbf", c3_2, 110);
+  expect_block(&t, "828785bf408825a849e95ba97d7f8925a849e95bb8e8b4bf", c3_3,
+               164);
+  hpack_table_free(&t);
+
+  // C.5: responses through a 256-byte table, evicting as they go
+  hpack_table_init(&t);
+  t.max_size = 256;
+  expect_block(&t, C5_1, c5_1, 222);
+  expect_block(&t, C5_2, c5_2, 222);
+  CHECK(t.count == 4);
+  expect_block(&t, C5_3, c5_3, 215);
+  CHECK(t.count == 3);
+  hpack_table_free(&t);
+
+  // C.6: the same responses with Huffman strings
+  hpack_table_init(&t);
+  t.max_size = 256;
+  expect_block(&t,
+               "488264025885aec3771a4b6196d07abe941054d444a8200595040b8166"
+               "e082a62d1bff6e919d29ad171863c78f0b97c8e9ae82ae43d3",
+               c5_1, 222);
+  expect_block(&t, "4883640effc1c0bf", c5_2, 222);
+  expect_block(&t,
+               "88c16196d07abe941054d444a8200595040b8166e084a62d1bffc05a83"
+               "9bd9ab77ad94e7821dd7f2e6c7b335dfdfcd5b3960d5af27087f3672c1"
+               "ab270fb5291f9587316065c003ed4ee5b1063d5007",
+               c5_3, 215);
+  hpack_table_free(&t);
+}
+
+// Encode a header list with indexing on and compare with the RFC bytes.
+static void expect_encoding(hpack_table_t *t, const char *const *list,
+                            const char *hex) {
+  uint8_t want[256], out[256];
+  size_t want_len = unhex(hex, want);
+  size_t len = 0;
+
+  for (size_t i = 0; list[i]; i++) {
+    // Split at the ": " after the name; pseudo-header names start with ':'
+    const char *sep = strstr(list[i] + 1, ": ");
+    char name[64];
+    snprintf(name, sizeof(name), "%.*s", (int)(sep - list[i]), list[i]);
+    size_t n = hpack_encode(t, out + len, sizeof(out) - len, name, sep + 2,
+                            strlen(sep + 2), true);
+    CHECK(n > 0);
+    len += n;
+  }
+  CHECK(len == want_len && memcmp(out, want, len) == 0);
+}
+
+static void test_encode(void) {
+  hpack_table_t t;
+
+  hpack_table_init(&t);
+  expect_encoding(&t, c3_1, C3_1);
+  expect_encoding(&t, c3_2, C3_2);
+  expect_encoding(&t, c3_3, C3_3);
+  CHECK(t.size == 164);
+  hpack_table_free(&t);
+
+  // The RFC blocks carry no size update, so skip hpack_encode_begin
+  hpack_table_init(&t);
+  t.max_size = 256;
+  expect_encoding(&t, c5_1, C5_1);
+  expect_encoding(&t, c5_2, C5_2);
+  expect_encoding(&t, c5_3, C5_3);
+  CHECK(t.size == 215);
+  hpack_table_free(&t);
+
+  // A limit change is announced once, at the start of the next block
+  uint8_t out[16];
+  hpack_table_init(&t);
+  hpack_table_limit(&t, 256);
+  CHECK(hpack_encode_begin(&t, out, sizeof(out)) == 3);
+  CHECK(out[0] == 0x3f && out[1] == 0xe1 && out[2] == 0x01);
+  CHECK(hpack_encode_begin(&t, out, sizeof(out)) == 0);
+  hpack_table_free(&t);
+}
+
+int main(void) {
+  test_decode();
+  test_encode();
+  return check_result("test_hpack");
+}
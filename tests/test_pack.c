@@ -0,0 +1,99 @@
+// pack_build() over a scratch tree: in-root files and links are packed,
+// links escaping the root and directory links (including a loop) are not.
+
+#include "../pack.h"
+#include "check.h"
+#include <glob.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static void write_file(const char *path, const char *data) {
+  FILE *f = fopen(path, "w");
+  CHECK(f != NULL);
+  if (f) {
+    fputs(data, f);
+    fclose(f);
+  }
+}
+
+static bool packed_as(const char *rel, const char *data) {
+  const pack_entry_t *e = pack_lookup(rel);
+  if (!e)
+    return false;
+  pack_span_t body = e->body[PACK_IDENTITY];
+  return body.len == strlen(data) &&
+         memcmp(pack_data(body), data, body.len) == 0;
+}
+
+int main(void) {
+  char base[] = "/tmp/test_pack.XXXXXX";
+  if (!mkdtemp(base)) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  char root[PATH_MAX];
+  char path[PATH_MAX * 2];
+  snprintf(root, sizeof(root), "%s/root", base);
+  CHECK(mkdir(root, 0700) == 0);
+  snprintf(path, sizeof(path), "%s/outside", base);
+  CHECK(mkdir(path, 0700) == 0);
+  snprintf(path, sizeof(path), "%s/outside/secret", base);
+  write_file(path, "secret");
+
+  CHECK(chdir(root) == 0);
+  CHECK(mkdir("sub", 0700) == 0);
+  write_file("index.html", "index");
+  write_file("sub/a.css", "css");
+  CHECK(symlink("index.html", "rel_in") == 0);
+  snprintf(path, sizeof(path), "%s/sub/a.css", root);
+  CHECK(symlink(path, "abs_in") == 0);
+  CHECK(symlink("../outside/secret", "rel_out") == 0);
+  snprintf(path, sizeof(path), "%s/outside/secret", base);
+  CHECK(symlink(path, "abs_out") == 0);
+  CHECK(symlink("/etc/passwd", "passwd") == 0);
+  CHECK(symlink("/etc", "etc") == 0);
+  CHECK(symlink("..", "sub/up") == 0);
+  CHECK(symlink("dangling", "dangling") == 0);
+  CHECK(chdir(base) == 0);
+
+  CHECK(pack_build("root", "test.pack"));
+  CHECK(pack_open("test.pack"));
+
+  CHECK(packed_as("index.html", "index"));
+  CHECK(packed_as("sub/a.css", "css"));
+  CHECK(packed_as("rel_in", "index"));
+  CHECK(packed_as("abs_in", "css"));
+
+  CHECK(!pack_lookup("rel_out"));
+  CHECK(!pack_lookup("abs_out"));
+  CHECK(!pack_lookup("passwd"));
+  CHECK(!pack_lookup("etc/passwd"));
+  CHECK(!pack_lookup("sub/up/index.html"));
+  CHECK(!pack_lookup("dangling"));
+
+  // Rebuild while mapped: the old mapping must stay readable
+  write_file("root/index.html", "rebuilt index, longer than the first");
+  CHECK(pack_build("root", "test.pack"));
+  CHECK(packed_as("index.html", "index"));
+  CHECK(packed_as("sub/a.css", "css"));
+  glob_t leftovers;
+  CHECK(glob("test.pack.*", 0, NULL, &leftovers) == GLOB_NOMATCH);
+  globfree(&leftovers);
+
+  pack_close();
+  CHECK(pack_open("test.pack"));
+  CHECK(packed_as("index.html", "rebuilt index, longer than the first"));
+  pack_close();
+
+  char cmd[PATH_MAX + 16];
+  snprintf(cmd, sizeof(cmd), "rm -rf %s", base);
+  if (system(cmd) != 0)
+    fprintf(stderr, "Could not remove %s\n", base);
+
+  return check_result("test_pack");
+}
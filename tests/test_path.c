@@ -0,0 +1,139 @@
+// path_normalize() cases and path_open() against a scratch root holding
+// in-root and escaping symlinks, both relative and absolute.
+
+#include "../path.h"
+#include "check.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static void expect_path(const char *in, const char *want) {
+  char out[256];
+  bool ok = path_normalize(in, out, sizeof(out));
+  if (!want) {
+    if (ok)
+      fprintf(stderr, "normalize(\"%s\") = \"%s\", want reject\n", in, out);
+    CHECK(!ok);
+    return;
+  }
+  if (!ok || strcmp(out, want) != 0)
+    fprintf(stderr, "normalize(\"%s\") = %s%s, want \"%s\"\n", in,
+            ok ? "" : "reject ", ok ? out : "", want);
+  CHECK(ok && strcmp(out, want) == 0);
+}
+
+static void test_normalize(void) {
+  expect_path("/", ".");
+  expect_path("/index.html", "index.html");
+  expect_path("//a///b/", "a/b");
+  expect_path("/a/./b/.", "a/b");
+  expect_path("/a/b/../c", "a/c");
+  expect_path("/a/..", ".");
+  expect_path("/..", NULL);
+  expect_path("/a/../../etc/passwd", NULL);
+
+  expect_path("/%2e%2e/etc/passwd", NULL);
+  expect_path("/%2E%2e/etc/passwd", NULL);
+  expect_path("/a/%2e%2e/b", "b");
+  expect_path("/a/.%2e/.%2E/x", NULL);
+  expect_path("/a%2fb", "a/b");
+  expect_path("/a%2f..%2f..%2fetc", NULL);
+  expect_path("/a%2F%2e%2e", ".");
+  expect_path("/a%20b.html", "a b.html");
+
+  expect_path("/a%00.html", NULL);
+  expect_path("/a%0", NULL);
+  expect_path("/a%zz", NULL);
+
+  expect_path("/a.html?x=../../etc", "a.html");
+  expect_path("/a.html#../..", "a.html");
+  expect_path("/a/..?/..", ".");
+  expect_path("/..?x", NULL);
+  expect_path("/a%3fb", "a?b");
+}
+
+static bool opens(const char *rel) {
+  int fd = path_open(rel, O_RDONLY);
+  if (fd < 0)
+    return false;
+  close(fd);
+  return true;
+}
+
+static void test_open(const char *base) {
+  char root[PATH_MAX];
+  char outside[PATH_MAX];
+  char target[PATH_MAX * 2];
+  snprintf(root, sizeof(root), "%s/root", base);
+  snprintf(outside, sizeof(outside), "%s/outside", base);
+
+  CHECK(mkdir(root, 0700) == 0);
+  CHECK(mkdir(outside, 0700) == 0);
+  snprintf(target, sizeof(target), "%s/sub", root);
+  CHECK(mkdir(target, 0700) == 0);
+  snprintf(target, sizeof(target), "%s/index.html", root);
+  FILE *f = fopen(target, "w");
+  CHECK(f != NULL);
+  if (f)
+    fclose(f);
+  snprintf(target, sizeof(target), "%s/secret", outside);
+  f = fopen(target, "w");
+  CHECK(f != NULL);
+  if (f)
+    fclose(f);
+
+  CHECK(chdir(root) == 0);
+  CHECK(symlink("index.html", "rel_in") == 0);
+  CHECK(symlink("../index.html", "sub/up_in") == 0);
+  CHECK(symlink("../outside/secret", "rel_out") == 0);
+  snprintf(target, sizeof(target), "%s/index.html", root);
+  CHECK(symlink(target, "abs_in") == 0);
+  snprintf(target, sizeof(target), "%s/secret", outside);
+  CHECK(symlink(target, "abs_out") == 0);
+  CHECK(symlink(outside, "dir_out") == 0);
+  CHECK(symlink("loop", "loop") == 0);
+
+  CHECK(path_init(root));
+
+  CHECK(opens("index.html"));
+  CHECK(opens("."));
+  CHECK(opens("rel_in"));
+  CHECK(opens("sub/up_in"));
+  CHECK(opens("abs_in"));
+  CHECK(!opens("missing"));
+  CHECK(errno == ENOENT);
+  CHECK(!opens("loop"));
+  CHECK(errno == ELOOP);
+
+  CHECK(!opens("rel_out"));
+  CHECK(errno == EXDEV);
+  CHECK(!opens("abs_out"));
+  CHECK(errno == EXDEV);
+  CHECK(!opens("dir_out/secret"));
+  CHECK(errno == EXDEV);
+
+  path_cleanup();
+}
+
+int main(void) {
+  char base[] = "/tmp/test_path.XXXXXX";
+  if (!mkdtemp(base)) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  test_normalize();
+  test_open(base);
+
+  char cmd[PATH_MAX + 16];
+  snprintf(cmd, sizeof(cmd), "rm -rf %s", base);
+  if (system(cmd) != 0)
+    fprintf(stderr, "Could not remove %s\n", base);
+
+  return check_result("test_path");
+}
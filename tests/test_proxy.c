@@ -0,0 +1,226 @@
+// proxy_forward() against a stand-in upstream on loopback: Content-Length,
+// chunked and close-delimited bodies, pooled connection reuse, and the
+// retry after a pooled connection dies, which must be idempotent-only.
+
+#include "../http.h"
+#include "../proxy.h"
+#include "check.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static _Atomic int accepts;  // Upstream connections opened
+static _Atomic int requests; // Requests the upstream read
+static _Atomic bool drop_next; // Close on the next request, unanswered
+
+static void send_str(int fd, const char *s) {
+  size_t len = strlen(s);
+  while (len > 0) {
+    ssize_t n = send(fd, s, len, MSG_NOSIGNAL);
+    if (n <= 0)
+      return;
+    s += n;
+    len -= n;
+  }
+}
+
+// One upstream connection: read a head (and any Content-Length body),
+// answer by path.
+static void *upstream_conn(void *arg) {
+  int fd = (int)(intptr_t)arg;
+  char buf[4096];
+  size_t have = 0;
+
+  while (1) {
+    char *end;
+    while (!(end = memmem(buf, have, "\r\n\r\n", 4))) {
+      ssize_t n = recv(fd, buf + have, sizeof(buf) - 1 - have, 0);
+      if (n <= 0)
+        goto done;
+      have += n;
+    }
+    buf[have] = '\0';
+    size_t head = end + 4 - buf;
+    char *cl = strcasestr(buf, "Content-Length:");
+    size_t body_len = cl && cl < end ? strtoul(cl + 15, NULL, 10) : 0;
+    while (have < head + body_len) {
+      ssize_t n = recv(fd, buf + have, sizeof(buf) - 1 - have, 0);
+      if (n <= 0)
+        goto done;
+      have += n;
+    }
+    atomic_fetch_add(&requests, 1);
+
+    if (atomic_exchange(&drop_next, false))
+      goto done;
+
+    char path[64] = "";
+    sscanf(buf, "%*s %63s", path);
+    char reply[512];
+    if (strcmp(path, "/api/len") == 0) {
+      send_str(fd, "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhello");
+    } else if (strcmp(path, "/api/echo") == 0) {
+      snprintf(reply, sizeof(reply),
+               "HTTP/1.1 201 Created\r\nContent-Length: %zu\r\n\r\n%.*s",
+               body_len, (int)body_len, buf + head);
+      send_str(fd, reply);
+    } else if (strcmp(path, "/api/chunked") == 0) {
+      send_str(fd, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+                   "3\r\nhel\r\n2\r\nlo\r\n0\r\nX-Trailer: yes\r\n\r\n");
+    } else if (strcmp(path, "/api/close") == 0) {
+      send_str(fd, "HTTP/1.1 200 OK\r\nConnection: close\r\n\r\n"
+                   "until close");
+      goto done;
+    } else {
+      send_str(fd, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+    }
+
+    memmove(buf, buf + head + body_len, have - head - body_len);
+    have -= head + body_len;
+  }
+
+done:
+  close(fd);
+  return NULL;
+}
+
+static void *upstream_accept(void *arg) {
+  int listen_fd = (int)(intptr_t)arg;
+  while (1) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0)
+      return NULL;
+    atomic_fetch_add(&accepts, 1);
+    pthread_t t;
+    pthread_create(&t, NULL, upstream_conn, (void *)(intptr_t)fd);
+    pthread_detach(t);
+  }
+}
+
+static int listen_loopback(int *port) {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  struct sockaddr_in addr = {.sin_family = AF_INET,
+                             .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+  socklen_t len = sizeof(addr);
+  if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(fd, 16) < 0 ||
+      getsockname(fd, (struct sockaddr *)&addr, &len) < 0)
+    return -1;
+  *port = ntohs(addr.sin_port);
+  return fd;
+}
+
+// A connected client/server pair; the server end is non-blocking like
+// an accepted connection.
+static void client_pair(int listen_fd, int port, int *client, int *server) {
+  struct sockaddr_in addr = {.sin_family = AF_INET,
+                             .sin_port = htons(port),
+                             .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+  *client = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  CHECK(connect(*client, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+  *server = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  CHECK(*server >= 0);
+}
+
+// Send one request through proxy_forward(); returns what the client got.
+static int forward(int listen_fd, int port, const char *request, char *out,
+                   size_t cap) {
+  int client, server;
+  client_pair(listen_fd, port, &client, &server);
+  send_str(client, request);
+
+  http_request_t req;
+  int status = -1;
+  struct pollfd pfd = {.fd = server, .events = POLLIN};
+  CHECK(poll(&pfd, 1, 1000) == 1);
+  CHECK(http_parse_request(server, &req) == 0);
+  proxy_route_t *route = proxy_match("api/x");
+  CHECK(route != NULL);
+  if (route)
+    status = proxy_forward(server, &req, route);
+  close(server);
+
+  size_t have = 0;
+  ssize_t n;
+  while (have < cap - 1 &&
+         (n = recv(client, out + have, cap - 1 - have, 0)) > 0)
+    have += n;
+  out[have] = '\0';
+  close(client);
+  return status;
+}
+
+int main(void) {
+  int up_port, port;
+  int up_fd = listen_loopback(&up_port);
+  int listen_fd = listen_loopback(&port);
+  CHECK(up_fd >= 0 && listen_fd >= 0);
+
+  pthread_t t;
+  pthread_create(&t, NULL, upstream_accept, (void *)(intptr_t)up_fd);
+  pthread_detach(t);
+
+  char spec[64];
+  snprintf(spec, sizeof(spec), "/api=127.0.0.1:%d", up_port);
+  CHECK(proxy_add_route(spec));
+
+  char out[4096];
+  CHECK(forward(listen_fd, port, "GET /api/len HTTP/1.1\r\nHost: x\r\n\r\n",
+                out, sizeof(out)) == 200);
+  CHECK(strstr(out, "HTTP/1.1 200 OK\r\n") == out);
+  CHECK(strstr(out, "\r\n\r\nhello"));
+
+  // Content-Length request body
+  CHECK(forward(listen_fd, port,
+                "POST /api/echo HTTP/1.1\r\nHost: x\r\n"
+                "Content-Length: 4\r\n\r\nping",
+                out, sizeof(out)) == 201);
+  CHECK(strstr(out, "\r\n\r\nping"));
+
+  CHECK(forward(listen_fd, port,
+                "GET /api/chunked HTTP/1.1\r\nHost: x\r\n\r\n", out,
+                sizeof(out)) == 200);
+  CHECK(strstr(out, "\r\n\r\n3\r\nhel\r\n2\r\nlo\r\n0\r\n"));
+  CHECK(strstr(out, "X-Trailer: yes\r\n\r\n"));
+
+  // Everything so far went over one pooled upstream connection
+  CHECK(atomic_load(&accepts) == 1);
+
+  CHECK(forward(listen_fd, port, "GET /api/close HTTP/1.1\r\nHost: x\r\n\r\n",
+                out, sizeof(out)) == 200);
+  CHECK(strstr(out, "Connection: close\r\n"));
+  CHECK(strstr(out, "\r\n\r\nuntil close"));
+
+  // A pooled connection that dies on the request: GET is retried on a
+  // fresh connection
+  CHECK(forward(listen_fd, port, "GET /api/len HTTP/1.1\r\nHost: x\r\n\r\n",
+                out, sizeof(out)) == 200);
+  int before = atomic_load(&requests);
+  int opened = atomic_load(&accepts);
+  atomic_store(&drop_next, true);
+  CHECK(forward(listen_fd, port, "GET /api/len HTTP/1.1\r\nHost: x\r\n\r\n",
+                out, sizeof(out)) == 200);
+  CHECK(strstr(out, "\r\n\r\nhello"));
+  CHECK(atomic_load(&requests) == before + 2);
+  CHECK(atomic_load(&accepts) == opened + 1);
+
+  // ...but a bodyless POST is not sent twice
+  before = atomic_load(&requests);
+  atomic_store(&drop_next, true);
+  CHECK(forward(listen_fd, port, "POST /api/len HTTP/1.1\r\nHost: x\r\n\r\n",
+                out, sizeof(out)) == 502);
+  CHECK(atomic_load(&requests) == before + 1);
+
+  proxy_cleanup();
+  close(up_fd);
+  close(listen_fd);
+  return check_result("test_proxy");
+}
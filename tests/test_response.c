@@ -0,0 +1,107 @@
+// response_mime() against every extension in tools/mime_types.h plus
+// near misses, and response_add() refusing to overflow its iovecs.
+
+#include "../response.h"
+#include "check.h"
+#include "../tools/mime_types.h"
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#define MIME_COUNT (sizeof(mimes) / sizeof(mimes[0]))
+#define TYPE_DEFAULT "application/octet-stream"
+
+static const char *listed(const char *ext) {
+  for (size_t i = 0; i < MIME_COUNT; i++)
+    if (strcasecmp(mimes[i].ext, ext) == 0)
+      return mimes[i].type;
+  return NULL;
+}
+
+static void expect_mime(const char *path, const char *want) {
+  const response_mime_t *m = response_mime(path);
+  if (strcmp(m->type, want) != 0)
+    fprintf(stderr, "mime(\"%s\") = %s, want %s\n", path, m->type, want);
+  CHECK(strcmp(m->type, want) == 0);
+  CHECK(m->type_len == strlen(want));
+
+  char header[128];
+  snprintf(header, sizeof(header), "Content-Type: %s\r\n", want);
+  CHECK(m->header_len == strlen(header));
+  CHECK(strncmp(m->header, header, m->header_len) == 0);
+}
+
+// A listed extension's neighbours: one byte longer or shorter.
+static void expect_near_misses(const char *ext) {
+  char variant[32];
+  char path[48];
+  size_t len = strlen(ext);
+
+  snprintf(variant, sizeof(variant), "%sx", ext);
+  snprintf(path, sizeof(path), "f.%s", variant);
+  const char *type = listed(variant);
+  expect_mime(path, type ? type : TYPE_DEFAULT);
+
+  if (len > 1) {
+    snprintf(variant, sizeof(variant), "%.*s", (int)(len - 1), ext);
+    snprintf(path, sizeof(path), "f.%s", variant);
+    type = listed(variant);
+    expect_mime(path, type ? type : TYPE_DEFAULT);
+  }
+}
+
+static void test_mime(void) {
+  char path[48];
+
+  for (size_t i = 0; i < MIME_COUNT; i++) {
+    const char *ext = mimes[i].ext;
+    snprintf(path, sizeof(path), "dir/file.%s", ext);
+    expect_mime(path, mimes[i].type);
+
+    char upper[32];
+    size_t len = strlen(ext);
+    for (size_t j = 0; j <= len; j++)
+      upper[j] = (char)toupper((unsigned char)ext[j]);
+    snprintf(path, sizeof(path), "FILE.%s", upper);
+    expect_mime(path, mimes[i].type);
+
+    expect_near_misses(ext);
+  }
+
+  expect_mime("file.unknown", TYPE_DEFAULT);
+  expect_mime("file.x", TYPE_DEFAULT);
+  expect_mime("file.", TYPE_DEFAULT);
+  expect_mime("file", TYPE_DEFAULT);
+  expect_mime("", TYPE_DEFAULT);
+  expect_mime("dir.html/file", TYPE_DEFAULT);
+  expect_mime("file.aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", TYPE_DEFAULT);
+  expect_mime("file.htm\xe9", TYPE_DEFAULT);
+  expect_mime("archive.tar.gz", "application/gzip");
+  expect_mime(".html", "text/html");
+}
+
+static void test_add(void) {
+  response_t r;
+  response_begin(&r, 200);
+  while (r.count < RESPONSE_IOV_MAX)
+    CHECK(response_add(&r, "x", 1));
+
+  CHECK(!response_add(&r, "y", 1));
+  CHECK(r.count == RESPONSE_IOV_MAX);
+  errno = 0;
+  CHECK(response_send(-1, &r, false) == -1);
+  CHECK(errno == EOVERFLOW);
+
+  // A new response starts clean
+  response_begin(&r, 200);
+  CHECK(!r.overflow);
+  CHECK(response_add(&r, "x", 1));
+}
+
+int main(void) {
+  test_mime();
+  test_add();
+
+  return check_result("test_response");
+}
@@ -1,12 +1,48 @@
 #include "thread_pool.h"
 #include "config.h"
-#include "http.h"
+#include "io.h"
+#include "proxy.h"
+#include "trace.h"
 #include "utils.h"
+#include <errno.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
-bool pool_init(thread_pool_t *p, queue_t *q, size_t min, size_t max) {
+#define LANE_POLL_MS 1000 // Stall checks need no finer granularity
+
+// Floating threads get the startup mask rather than inheriting the
+// creator's, which may be the pinned acceptor.
+static int start_thread(thread_pool_t *p, worker_t *w,
+                        void *(*fn)(void *)) {
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  if (p->affinity)
+    affinity_thread_attr(p->affinity, w->cpu, &attr);
+
+  int rc = pthread_create(&w->thread, &attr, fn, w);
+  pthread_attr_destroy(&attr);
+  return rc;
+}
+
+static int start_worker(thread_pool_t *p, size_t idx) {
+  worker_t *w = &p->workers[idx];
+  const affinity_t *aff = p->affinity;
+
+  w->cpu = -1;
+  if (aff && aff->count > 0)
+    w->cpu = aff->cpus[idx % aff->count];
+  w->home_cpu = w->cpu;
+  return start_thread(p, w, worker_thread);
+}
+
+bool pool_init(thread_pool_t *p, queue_t *q, size_t min, size_t max,
+               const affinity_t *aff) {
   p->queue = q;
+  p->affinity = aff;
   p->min_threads = min;
   p->max_threads = max;
   p->thread_count = min;
@@ -17,33 +53,314 @@ bool pool_init(thread_pool_t *p, queue_t *q, size_t min, size_t max) {
 
   atomic_init(&p->shutdown, false);
   atomic_init(&p->active_workers, 0);
+  atomic_init(&p->in_flight, 0);
+  atomic_init(&p->jobs, 0);
   pthread_mutex_init(&p->scale_mutex, NULL);
+  pthread_mutex_init(&p->submit_mutex, NULL);
+
+  bulk_lane_t *b = &p->bulk;
+  b->head = b->tail = NULL;
+  b->avg_wait_ms = 0;
+  atomic_init(&b->transfers, 0);
+  atomic_init(&b->bytes, 0);
+  atomic_init(&b->slices, 0);
+  b->parked = NULL;
+  b->polling = false;
+  pthread_mutex_init(&b->mutex, NULL);
+  pthread_cond_init(&b->cond, NULL);
+  b->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  b->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  struct epoll_event wake = {.events = EPOLLIN, .data.ptr = NULL};
+  if (b->epoll_fd < 0 || b->wake_fd < 0 ||
+      epoll_ctl(b->epoll_fd, EPOLL_CTL_ADD, b->wake_fd, &wake) < 0) {
+    log_error("Bulk lane epoll: %s", strerror(errno));
+    return false;
+  }
+  b->workers = calloc(LANE_BULK_THREADS, sizeof(worker_t));
+  if (!b->workers)
+    return false;
 
-  p->threads = calloc(max, sizeof(pthread_t));
-  if (!p->threads)
+  p->workers = calloc(max, sizeof(worker_t));
+  if (!p->workers)
     return false;
 
+  for (size_t i = 0; i < max; i++) {
+    p->workers[i].pool = p;
+    atomic_init(&p->workers[i].client_fd, -1);
+    atomic_init(&p->workers[i].upstream_fd, -1);
+  }
+
   for (size_t i = 0; i < min; i++) {
-    pthread_create(&p->threads[i], NULL, worker_thread, p);
+    start_worker(p, i);
+  }
+
+  for (b->thread_count = 0; b->thread_count < LANE_BULK_THREADS;
+       b->thread_count++) {
+    worker_t *w = &b->workers[b->thread_count];
+    w->pool = p;
+    w->cpu = w->home_cpu = -1;
+    atomic_init(&w->client_fd, -1);
+    atomic_init(&w->upstream_fd, -1);
+    if (start_thread(p, w, bulk_thread) != 0)
+      break;
   }
 
-  log_info("Thread pool initialized: %zu workers (min: %zu, max: %zu)", min,
-           min, max);
+  log_info("Thread pool initialized: %zu workers (min: %zu, max: %zu), "
+           "%zu bulk",
+           min, min, max, b->thread_count);
+  if (aff && aff->count > 0)
+    log_info("Workers pinned round-robin over %zu CPUs%s", aff->count,
+             aff->steer ? ", steering by SO_INCOMING_CPU" : "");
+  else if (aff && aff->steer)
+    log_info("Workers steered by SO_INCOMING_CPU");
   return true;
 }
 
 void pool_submit(thread_pool_t *p, job_t job) {
+  atomic_fetch_add_explicit(&p->in_flight, 1, memory_order_relaxed);
+  TRACE_PROBE2(enqueue, job.client_fd, queue_size_approx(p->queue));
+
+  // The queue is single-producer; bulk threads returning keep-alive
+  // connections produce too.
+  pthread_mutex_lock(&p->submit_mutex);
   while (!queue_enqueue(p->queue, job)) {
     if (p->thread_count < p->max_threads) {
       pool_scale_up(p);
     }
     usleep(1000);
   }
+  pthread_mutex_unlock(&p->submit_mutex);
+}
+
+static void bulk_wake(bulk_lane_t *b) {
+  uint64_t one = 1;
+  if (write(b->wake_fd, &one, sizeof(one)) < 0) {
+    // Counter saturated: the poller is already due to wake
+  }
+}
+
+// Caller holds b->mutex.
+static void ready_push(bulk_lane_t *b, bulk_item_t *item) {
+  item->next = NULL;
+  if (b->tail)
+    b->tail->next = item;
+  else
+    b->head = item;
+  b->tail = item;
+  pthread_cond_signal(&b->cond);
+  if (b->polling)
+    bulk_wake(b);
+}
+
+// Caller holds b->mutex.
+static void parked_remove(bulk_lane_t *b, bulk_item_t *item) {
+  if (item->prev)
+    item->prev->next = item->next;
+  else
+    b->parked = item->next;
+  if (item->next)
+    item->next->prev = item->prev;
+  item->next = item->prev = NULL;
+}
+
+static void bulk_submit(thread_pool_t *p, job_t job, http_transfer_t t) {
+  bulk_item_t *item = malloc(sizeof(*item));
+  if (!item) {
+    if (t.owns_fd)
+      close(t.file_fd);
+    close(job.client_fd);
+    atomic_fetch_sub_explicit(&p->in_flight, 1, memory_order_release);
+    return;
+  }
+
+  *item = (bulk_item_t){.job = job,
+                        .transfer = t,
+                        .start_offset = t.offset,
+                        .advised = -1,
+                        .enqueue_time = time_ms()};
+
+  bulk_lane_t *b = &p->bulk;
+  pthread_mutex_lock(&b->mutex);
+  ready_push(b, item);
+  pthread_mutex_unlock(&b->mutex);
+}
+
+// Body fully sent (or failed): return a keep-alive connection to the
+// latency lane for its next request, else close it.
+static void bulk_finish(thread_pool_t *p, bulk_item_t *item, bool ok) {
+  http_transfer_t *t = &item->transfer;
+  if (t->owns_fd)
+    close(t->file_fd);
+  if (item->registered)
+    epoll_ctl(p->bulk.epoll_fd, EPOLL_CTL_DEL, item->job.client_fd, NULL);
+
+  int status = ok ? t->status : TRACE_ABORTED;
+  TRACE_PROBE3(send_done, item->job.client_fd, status,
+               t->offset - item->start_offset);
+  trace_req_finish(&t->trace, status);
+
+  atomic_fetch_add_explicit(&p->bulk.transfers, 1, memory_order_relaxed);
+
+  if (ok && t->keep_alive && !http_draining() &&
+      item->job.requests < KEEPALIVE_MAX_REQ &&
+      !atomic_load_explicit(&p->shutdown, memory_order_acquire)) {
+    item->job.enqueue_time = time_ms();
+    item->job.accept_ticks = 0;
+    pool_submit(p, item->job);
+  } else {
+    close(item->job.client_fd);
+  }
+
+  atomic_fetch_sub_explicit(&p->in_flight, 1, memory_order_release);
+  free(item);
+}
+
+// The client's socket buffer is full: wait for POLLOUT off-thread.
+// Caller holds b->mutex; on false the item could not be armed.
+static bool bulk_park(bulk_lane_t *b, bulk_item_t *item) {
+  struct epoll_event ev = {.events = EPOLLOUT | EPOLLONESHOT,
+                           .data.ptr = item};
+  int op = item->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+  if (epoll_ctl(b->epoll_fd, op, item->job.client_fd, &ev) < 0)
+    return false;
+  item->registered = true;
+  item->parked_time = time_ms();
+
+  item->prev = NULL;
+  item->next = b->parked;
+  if (b->parked)
+    b->parked->prev = item;
+  b->parked = item;
+  if (b->polling)
+    bulk_wake(b);
+  return true;
+}
+
+// Run as the lane's single poller: move parked transfers whose client
+// became writable back to the ready list, and drop ones stalled for
+// LANE_STALL_MS. Only the poller receives events and expires items, so
+// no event can refer to an item that was freed. Called and returns with
+// b->mutex held.
+static void bulk_poll(thread_pool_t *p) {
+  bulk_lane_t *b = &p->bulk;
+  b->polling = true;
+  pthread_mutex_unlock(&b->mutex);
+
+  struct epoll_event events[64];
+  int n = epoll_wait(b->epoll_fd, events, 64, LANE_POLL_MS);
+
+  pthread_mutex_lock(&b->mutex);
+  for (int i = 0; i < n; i++) {
+    bulk_item_t *item = events[i].data.ptr;
+    if (!item) {
+      uint64_t count;
+      if (read(b->wake_fd, &count, sizeof(count)) < 0) {
+        // Already drained
+      }
+      continue;
+    }
+    parked_remove(b, item);
+    ready_push(b, item);
+  }
+
+  bulk_item_t *stalled = NULL;
+  uint64_t now = time_ms();
+  for (bulk_item_t *item = b->parked, *next; item; item = next) {
+    next = item->next;
+    if (now - item->parked_time >= LANE_STALL_MS) {
+      parked_remove(b, item);
+      item->next = stalled;
+      stalled = item;
+    }
+  }
+  pthread_mutex_unlock(&b->mutex);
+
+  while (stalled) {
+    bulk_item_t *item = stalled;
+    stalled = item->next;
+    bulk_finish(p, item, false);
+  }
+
+  pthread_mutex_lock(&b->mutex);
+  b->polling = false;
+}
+
+void *bulk_thread(void *arg) {
+  worker_t *w = arg;
+  thread_pool_t *p = w->pool;
+  bulk_lane_t *b = &p->bulk;
+
+  pthread_mutex_lock(&b->mutex);
+  while (!atomic_load_explicit(&p->shutdown, memory_order_acquire)) {
+    if (!b->head) {
+      if (b->parked && !b->polling)
+        bulk_poll(p);
+      else
+        pthread_cond_wait(&b->cond, &b->mutex);
+      continue;
+    }
+
+    bulk_item_t *item = b->head;
+    b->head = item->next;
+    if (!b->head)
+      b->tail = NULL;
+    item->next = NULL;
+
+    if (!item->started) {
+      item->started = true;
+      double wait = time_ms() - item->enqueue_time;
+      b->avg_wait_ms = p->alpha * wait + (1 - p->alpha) * b->avg_wait_ms;
+      trace_req_stage(&item->transfer.trace, TRACE_LANE_START);
+    }
+    pthread_mutex_unlock(&b->mutex);
+
+    // Advice follows the whole remaining body, not just this slice
+    http_transfer_t *t = &item->transfer;
+    size_t len = t->remaining < LANE_SLICE_BYTES ? t->remaining
+                                                 : LANE_SLICE_BYTES;
+    io_advise(t->file_fd, t->offset, t->offset + (off_t)t->remaining,
+              &item->advised);
+
+    bool blocked;
+    atomic_store_explicit(&w->client_fd, item->job.client_fd,
+                          memory_order_relaxed);
+    ssize_t sent = io_send_file_nowait(item->job.client_fd, t->file_fd,
+                                       t->offset, len, &blocked);
+    atomic_store_explicit(&w->client_fd, -1, memory_order_relaxed);
+
+    if (sent > 0) {
+      t->offset += sent;
+      t->remaining -= sent;
+      atomic_fetch_add_explicit(&b->bytes, sent, memory_order_relaxed);
+      atomic_fetch_add_explicit(&b->slices, 1, memory_order_relaxed);
+    }
+
+    if (t->remaining == 0 || (!blocked && sent <= 0)) {
+      bulk_finish(p, item, t->remaining == 0);
+      pthread_mutex_lock(&b->mutex);
+      continue;
+    }
+
+    pthread_mutex_lock(&b->mutex);
+    if (!blocked) {
+      // Round-robin: back of the line for the next slice
+      ready_push(b, item);
+    } else if (!bulk_park(b, item)) {
+      pthread_mutex_unlock(&b->mutex);
+      bulk_finish(p, item, false);
+      pthread_mutex_lock(&b->mutex);
+    }
+  }
+  pthread_mutex_unlock(&b->mutex);
+
+  return NULL;
 }
 
 void *worker_thread(void *arg) {
-  thread_pool_t *p = arg;
+  worker_t *w = arg;
+  thread_pool_t *p = w->pool;
   job_t job;
+  proxy_thread_init(&w->upstream_fd);
 
   while (!atomic_load_explicit(&p->shutdown, memory_order_relaxed)) {
     bool got_work = false;
@@ -59,6 +376,8 @@ void *worker_thread(void *arg) {
     }
 
     uint64_t wait_time = time_ms() - job.enqueue_time;
+    trace_conn_begin(job.client_fd, job.accept_ticks);
+    TRACE_PROBE2(dequeue, job.client_fd, wait_time);
 
     pthread_mutex_lock(&p->scale_mutex);
     p->avg_wait_ms = p->alpha * wait_time + (1 - p->alpha) * p->avg_wait_ms;
@@ -69,9 +388,33 @@ void *worker_thread(void *arg) {
       pool_scale_up(p);
     }
 
+    // Move to the core that handles this connection's packets for the
+    // life of the connection, not per request.
+    const affinity_t *aff = p->affinity;
+    if (aff && aff->steer && job.cpu >= 0 && job.cpu != w->cpu &&
+        job.cpu < CPU_SETSIZE && CPU_ISSET(job.cpu, &aff->set) &&
+        affinity_pin_self(job.cpu)) {
+      w->cpu = job.cpu;
+    }
+
+    atomic_fetch_add_explicit(&p->jobs, 1, memory_order_relaxed);
     atomic_fetch_add_explicit(&p->active_workers, 1, memory_order_relaxed);
-    http_handle_job(&job);
+    atomic_store_explicit(&w->client_fd, job.client_fd, memory_order_relaxed);
+    http_transfer_t bulk;
+    int rc = http_handle_job(&job, &bulk);
+    atomic_store_explicit(&w->client_fd, -1, memory_order_relaxed);
     atomic_fetch_sub_explicit(&p->active_workers, 1, memory_order_relaxed);
+
+    // Back to the -c placement, so skewed RSS cannot gather every worker
+    // on one core
+    if (w->cpu != w->home_cpu && affinity_restore_self(aff, w->home_cpu))
+      w->cpu = w->home_cpu;
+
+    // A handed-off job stays in flight until the bulk lane finishes it
+    if (rc == HTTP_JOB_BULK)
+      bulk_submit(p, job, bulk);
+    else
+      atomic_fetch_sub_explicit(&p->in_flight, 1, memory_order_release);
   }
 
   return NULL;
@@ -86,13 +429,14 @@ bool pool_scale_up(thread_pool_t *p) {
     return false;
   }
 
-  if (p->thread_count >= p->max_threads) {
+  if (p->thread_count >= p->max_threads ||
+      atomic_load_explicit(&p->shutdown, memory_order_acquire)) {
     pthread_mutex_unlock(&p->scale_mutex);
     return false;
   }
 
   size_t new_idx = p->thread_count++;
-  if (pthread_create(&p->threads[new_idx], NULL, worker_thread, p) != 0) {
+  if (start_worker(p, new_idx) != 0) {
     p->thread_count--;
     pthread_mutex_unlock(&p->scale_mutex);
     return false;
@@ -111,14 +455,88 @@ bool pool_scale_down(thread_pool_t *p) {
   return false;
 }
 
+bool pool_drain(thread_pool_t *p, uint64_t timeout_ms) {
+  uint64_t deadline = time_ms() + timeout_ms;
+
+  while (atomic_load_explicit(&p->in_flight, memory_order_acquire) > 0) {
+    if (time_ms() >= deadline)
+      return false;
+    usleep(1000);
+  }
+
+  return true;
+}
+
 void pool_shutdown(thread_pool_t *p) {
+  // Under scale_mutex so no worker can start another thread past this point
+  pthread_mutex_lock(&p->scale_mutex);
   atomic_store_explicit(&p->shutdown, true, memory_order_release);
+  size_t count = p->thread_count;
+  pthread_mutex_unlock(&p->scale_mutex);
+
+  bulk_lane_t *b = &p->bulk;
+  pthread_mutex_lock(&b->mutex);
+  pthread_cond_broadcast(&b->cond);
+  bulk_wake(b);
+  pthread_mutex_unlock(&b->mutex);
+
+  size_t aborted = 0;
+  for (size_t i = 0; i < count; i++) {
+    int fd = atomic_load_explicit(&p->workers[i].client_fd,
+                                  memory_order_relaxed);
+    if (fd >= 0 && shutdown(fd, SHUT_RDWR) == 0)
+      aborted++;
+    // A silent upstream would otherwise hold the worker for
+    // PROXY_TIMEOUT_MS
+    fd = atomic_load_explicit(&p->workers[i].upstream_fd,
+                              memory_order_relaxed);
+    if (fd >= 0)
+      shutdown(fd, SHUT_RDWR);
+  }
+  for (size_t i = 0; i < b->thread_count; i++) {
+    int fd = atomic_load_explicit(&b->workers[i].client_fd,
+                                  memory_order_relaxed);
+    if (fd >= 0 && shutdown(fd, SHUT_RDWR) == 0)
+      aborted++;
+  }
+  if (aborted > 0)
+    log_info("Aborted %zu active connections", aborted);
+
+  for (size_t i = 0; i < count; i++) {
+    pthread_join(p->workers[i].thread, NULL);
+  }
+  for (size_t i = 0; i < b->thread_count; i++) {
+    pthread_join(b->workers[i].thread, NULL);
+  }
 
-  for (size_t i = 0; i < p->thread_count; i++) {
-    pthread_join(p->threads[i], NULL);
+  // Transfers still queued or parked after the deadline
+  bulk_item_t *lists[] = {b->head, b->parked};
+  for (size_t i = 0; i < 2; i++) {
+    while (lists[i]) {
+      bulk_item_t *item = lists[i];
+      lists[i] = item->next;
+      if (item->transfer.owns_fd)
+        close(item->transfer.file_fd);
+      close(item->job.client_fd);
+      free(item);
+    }
   }
+  b->head = b->tail = b->parked = NULL;
+  close(b->epoll_fd);
+  close(b->wake_fd);
+
+  log_info("Latency lane: %lu connections, avg wait %.2fms; "
+           "bulk lane: %lu transfers, %.1f MB in %lu slices, avg wait %.2fms",
+           (unsigned long)atomic_load(&p->jobs), p->avg_wait_ms,
+           (unsigned long)atomic_load(&b->transfers),
+           atomic_load(&b->bytes) / (1024.0 * 1024.0),
+           (unsigned long)atomic_load(&b->slices), b->avg_wait_ms);
 
-  free(p->threads);
+  free(p->workers);
+  free(b->workers);
+  pthread_mutex_destroy(&b->mutex);
+  pthread_cond_destroy(&b->cond);
+  pthread_mutex_destroy(&p->submit_mutex);
   pthread_mutex_destroy(&p->scale_mutex);
 
   log_info("Thread pool shutdown complete");
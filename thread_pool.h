@@ -1,37 +1,103 @@
 #ifndef THREAD_POOL_H
 #define THREAD_POOL_H
 
+#include "affinity.h"
+#include "http.h"
 #include "queue.h"
 #include <pthread.h>
 #include <stdatomic.h>
 
+struct thread_pool;
+
 typedef struct {
+  struct thread_pool *pool;
+  pthread_t thread;
+  _Atomic int client_fd;   // Connection being served, -1 when idle
+  _Atomic int upstream_fd; // Proxy upstream being relayed, -1 if none
+  int cpu;                 // CPU the worker is pinned to, -1 if floating
+  int home_cpu;            // CPU from -c, -1 if none; cpu between steers
+} worker_t;
+
+typedef struct bulk_item {
+  job_t job;
+  http_transfer_t transfer;
+  off_t start_offset; // transfer.offset at hand-off
+  off_t advised;      // io_advise() progress, -1 before the first slice
+  uint64_t enqueue_time;
+  uint64_t parked_time; // When the client last stopped accepting data
+  bool started;
+  bool registered; // client fd is in the lane's epoll set
+  struct bulk_item *next;
+  struct bulk_item *prev; // Parked list only
+} bulk_item_t;
+
+// Throughput lane: a fixed number of threads take turns sending up to
+// LANE_SLICE_BYTES of each large body, so a few huge downloads share
+// bounded concurrency and never occupy the latency workers. A slice ends
+// early when the client's socket buffer fills; the transfer is parked
+// until epoll reports it writable, so slow readers never hold a thread.
+// One idle lane thread at a time waits in epoll_wait for parked ones.
+typedef struct {
+  bulk_item_t *head; // Ready to send
+  bulk_item_t *tail;
+  bulk_item_t *parked; // Waiting for POLLOUT
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int epoll_fd;
+  int wake_fd;  // eventfd: interrupts the poller
+  bool polling; // A thread is in epoll_wait
+
+  worker_t *workers;
+  size_t thread_count;
+
+  _Atomic uint64_t transfers;
+  _Atomic uint64_t bytes;
+  _Atomic uint64_t slices;
+  double avg_wait_ms; // Hand-off to first slice, EMA under mutex
+} bulk_lane_t;
+
+typedef struct thread_pool {
   queue_t *queue;
 
-  pthread_t *threads;
+  worker_t *workers;
   size_t thread_count;
   size_t min_threads;
   size_t max_threads;
+  const affinity_t *affinity; // NULL: default scheduling
 
   _Atomic bool shutdown;
   _Atomic size_t active_workers;
+  _Atomic size_t in_flight; // Submitted but not yet finished
 
-  // Adaptive metrics
+  bulk_lane_t bulk;
+
+  // Adaptive metrics (latency lane)
+  _Atomic uint64_t jobs;
   double avg_wait_ms; // Exponential moving average
   double alpha;       // EMA smoothing factor (0.3)
   uint64_t last_scale_time;
   uint64_t scale_cooldown_ms;
 
   pthread_mutex_t scale_mutex;
+  pthread_mutex_t submit_mutex;
 
 } thread_pool_t;
 
-bool pool_init(thread_pool_t *p, queue_t *q, size_t min, size_t max);
+// aff (may be NULL) must outlive the pool.
+bool pool_init(thread_pool_t *p, queue_t *q, size_t min, size_t max,
+               const affinity_t *aff);
 void pool_submit(thread_pool_t *p, job_t job);
+// Stops workers and joins them. Connections still being served are shut
+// down so their workers return promptly; call pool_drain() first for a
+// graceful stop. Jobs left in the queue are not touched.
 void pool_shutdown(thread_pool_t *p);
 
+// Wait until every submitted job has finished. False on timeout.
+bool pool_drain(thread_pool_t *p, uint64_t timeout_ms);
+
 // Internal
 void *worker_thread(void *arg);
+void *bulk_thread(void *arg);
 bool pool_scale_up(thread_pool_t *p);
 bool pool_scale_down(thread_pool_t *p);
 
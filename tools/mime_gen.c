@@ -0,0 +1,119 @@
+// Build-time generator for mime_table.h: a perfect hash from file
+// extension to MIME type, so response_mime() is one hash, one table load
+// and one compare. Uses hash-and-displace: keys are split into buckets by
+// mime_hash(ext, 0), then each bucket, largest first, gets the smallest
+// seed that sends all of its keys to free slots.
+//
+// Usage: mime_gen > mime_table.h
+
+#include "../mime_hash.h"
+#include "mime_types.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TABLE_SIZE 256 // Slots; power of two, at least the key count
+#define BUCKETS 64     // Power of two, roughly keys / 2
+#define EXT_MAX 15
+#define SEED_MAX 65535
+
+#define MIME_COUNT (sizeof(mimes) / sizeof(mimes[0]))
+
+static int slots[TABLE_SIZE];         // Index into mimes, or -1
+static unsigned seeds[BUCKETS];       // Displacement seed per bucket
+static int members[BUCKETS][MIME_COUNT];
+static size_t member_count[BUCKETS];
+
+static uint32_t slot_of(int m, unsigned seed) {
+  const char *ext = mimes[m].ext;
+  return mime_hash(ext, strlen(ext), seed) & (TABLE_SIZE - 1);
+}
+
+// Try seed for bucket b; claims its slots and returns true if all fit.
+static bool place(size_t b, unsigned seed) {
+  uint32_t taken[MIME_COUNT];
+  for (size_t i = 0; i < member_count[b]; i++) {
+    uint32_t s = slot_of(members[b][i], seed);
+    if (slots[s] >= 0)
+      return false;
+    for (size_t j = 0; j < i; j++)
+      if (taken[j] == s)
+        return false;
+    taken[i] = s;
+  }
+
+  for (size_t i = 0; i < member_count[b]; i++)
+    slots[taken[i]] = members[b][i];
+  seeds[b] = seed;
+  return true;
+}
+
+static int by_size(const void *a, const void *b) {
+  size_t na = member_count[*(const size_t *)a];
+  size_t nb = member_count[*(const size_t *)b];
+  return (na < nb) - (na > nb);
+}
+
+int main(void) {
+  memset(slots, -1, sizeof(slots));
+
+  for (size_t m = 0; m < MIME_COUNT; m++) {
+    const char *ext = mimes[m].ext;
+    size_t len = strlen(ext);
+    if (len > EXT_MAX) {
+      fprintf(stderr, "mime_gen: extension too long: %s\n", ext);
+      return 1;
+    }
+    for (size_t k = 0; k < m; k++) {
+      if (strcmp(mimes[k].ext, ext) == 0) {
+        fprintf(stderr, "mime_gen: duplicate extension: %s\n", ext);
+        return 1;
+      }
+    }
+    size_t b = mime_hash(ext, len, 0) & (BUCKETS - 1);
+    members[b][member_count[b]++] = (int)m;
+  }
+
+  size_t order[BUCKETS];
+  for (size_t b = 0; b < BUCKETS; b++)
+    order[b] = b;
+  qsort(order, BUCKETS, sizeof(order[0]), by_size);
+
+  for (size_t i = 0; i < BUCKETS; i++) {
+    size_t b = order[i];
+    if (member_count[b] == 0)
+      break;
+    unsigned seed = 1;
+    while (seed <= SEED_MAX && !place(b, seed))
+      seed++;
+    if (seed > SEED_MAX) {
+      fprintf(stderr, "mime_gen: no seed for bucket %zu\n", b);
+      return 1;
+    }
+  }
+
+  printf("// Generated by tools/mime_gen.c; do not edit.\n\n");
+  printf("#define MIME_TABLE_SIZE %d\n", TABLE_SIZE);
+  printf("#define MIME_BUCKETS %d\n", BUCKETS);
+  printf("#define MIME_EXT_MAX %d\n\n", EXT_MAX);
+
+  printf("static const uint16_t mime_seeds[MIME_BUCKETS] = {");
+  for (size_t b = 0; b < BUCKETS; b++)
+    printf("%s%u,", b % 12 ? " " : "\n    ", seeds[b]);
+  printf("\n};\n\n");
+
+  printf("static const mime_entry_t mime_table[MIME_TABLE_SIZE] = {\n");
+  for (size_t s = 0; s < TABLE_SIZE; s++) {
+    if (slots[s] < 0)
+      continue;
+    const mime_t *m = &mimes[slots[s]];
+    size_t type_len = strlen(m->type);
+    printf("    [%zu] = {\"%s\", %zu,\n", s, m->ext, strlen(m->ext));
+    printf("           {\"%s\", %zu,\n", m->type, type_len);
+    printf("            \"Content-Type: %s\\r\\n\", %zu}},\n", m->type,
+           type_len + 16);
+  }
+  printf("};\n");
+  return 0;
+}
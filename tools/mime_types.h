@@ -0,0 +1,147 @@
+// Extension -> MIME type list, shared by tools/mime_gen.c and
+// tests/test_response.c. Extensions are lowercase and unique.
+
+#ifndef MIME_TYPES_H
+#define MIME_TYPES_H
+
+typedef struct {
+  const char *ext;
+  const char *type;
+} mime_t;
+
+static const mime_t mimes[] = {
+    {"html", "text/html"},
+    {"htm", "text/html"},
+    {"shtml", "text/html"},
+    {"css", "text/css"},
+    {"xml", "text/xml"},
+    {"txt", "text/plain"},
+    {"md", "text/markdown"},
+    {"csv", "text/csv"},
+    {"ics", "text/calendar"},
+    {"vtt", "text/vtt"},
+    {"mml", "text/mathml"},
+    {"htc", "text/x-component"},
+    {"jad", "text/vnd.sun.j2me.app-descriptor"},
+    {"wml", "text/vnd.wap.wml"},
+    {"js", "application/javascript"},
+    {"mjs", "application/javascript"},
+    {"json", "application/json"},
+    {"map", "application/json"},
+    {"webmanifest", "application/manifest+json"},
+    {"jsonld", "application/ld+json"},
+    {"atom", "application/atom+xml"},
+    {"rss", "application/rss+xml"},
+    {"xhtml", "application/xhtml+xml"},
+    {"xspf", "application/xspf+xml"},
+    {"wasm", "application/wasm"},
+    {"pdf", "application/pdf"},
+    {"rtf", "application/rtf"},
+    {"ps", "application/postscript"},
+    {"eps", "application/postscript"},
+    {"ai", "application/postscript"},
+    {"epub", "application/epub+zip"},
+    {"doc", "application/msword"},
+    {"xls", "application/vnd.ms-excel"},
+    {"ppt", "application/vnd.ms-powerpoint"},
+    {"docx", "application/vnd.openxmlformats-officedocument."
+             "wordprocessingml.document"},
+    {"xlsx", "application/vnd.openxmlformats-officedocument."
+             "spreadsheetml.sheet"},
+    {"pptx", "application/vnd.openxmlformats-officedocument."
+             "presentationml.presentation"},
+    {"odg", "application/vnd.oasis.opendocument.graphics"},
+    {"odp", "application/vnd.oasis.opendocument.presentation"},
+    {"ods", "application/vnd.oasis.opendocument.spreadsheet"},
+    {"odt", "application/vnd.oasis.opendocument.text"},
+    {"eot", "application/vnd.ms-fontobject"},
+    {"m3u8", "application/vnd.apple.mpegurl"},
+    {"kml", "application/vnd.google-earth.kml+xml"},
+    {"kmz", "application/vnd.google-earth.kmz"},
+    {"wmlc", "application/vnd.wap.wmlc"},
+    {"jar", "application/java-archive"},
+    {"war", "application/java-archive"},
+    {"ear", "application/java-archive"},
+    {"hqx", "application/mac-binhex40"},
+    {"zip", "application/zip"},
+    {"gz", "application/gzip"},
+    {"tgz", "application/gzip"},
+    {"bz2", "application/x-bzip2"},
+    {"xz", "application/x-xz"},
+    {"zst", "application/zstd"},
+    {"tar", "application/x-tar"},
+    {"7z", "application/x-7z-compressed"},
+    {"rar", "application/x-rar-compressed"},
+    {"rpm", "application/x-redhat-package-manager"},
+    {"deb", "application/vnd.debian.binary-package"},
+    {"sh", "application/x-sh"},
+    {"pl", "application/x-perl"},
+    {"pm", "application/x-perl"},
+    {"tcl", "application/x-tcl"},
+    {"tk", "application/x-tcl"},
+    {"swf", "application/x-shockwave-flash"},
+    {"jnlp", "application/x-java-jnlp-file"},
+    {"der", "application/x-x509-ca-cert"},
+    {"pem", "application/x-x509-ca-cert"},
+    {"crt", "application/x-x509-ca-cert"},
+    {"xpi", "application/x-xpinstall"},
+    {"bin", "application/octet-stream"},
+    {"exe", "application/octet-stream"},
+    {"dll", "application/octet-stream"},
+    {"dmg", "application/octet-stream"},
+    {"iso", "application/octet-stream"},
+    {"img", "application/octet-stream"},
+    {"msi", "application/octet-stream"},
+    {"png", "image/png"},
+    {"apng", "image/apng"},
+    {"jpg", "image/jpeg"},
+    {"jpeg", "image/jpeg"},
+    {"gif", "image/gif"},
+    {"webp", "image/webp"},
+    {"avif", "image/avif"},
+    {"jxl", "image/jxl"},
+    {"heic", "image/heic"},
+    {"svg", "image/svg+xml"},
+    {"svgz", "image/svg+xml"},
+    {"ico", "image/x-icon"},
+    {"bmp", "image/bmp"},
+    {"tif", "image/tiff"},
+    {"tiff", "image/tiff"},
+    {"wbmp", "image/vnd.wap.wbmp"},
+    {"jng", "image/x-jng"},
+    {"woff", "font/woff"},
+    {"woff2", "font/woff2"},
+    {"ttf", "font/ttf"},
+    {"otf", "font/otf"},
+    {"mid", "audio/midi"},
+    {"midi", "audio/midi"},
+    {"kar", "audio/midi"},
+    {"mp3", "audio/mpeg"},
+    {"ogg", "audio/ogg"},
+    {"oga", "audio/ogg"},
+    {"opus", "audio/opus"},
+    {"m4a", "audio/mp4"},
+    {"aac", "audio/aac"},
+    {"flac", "audio/flac"},
+    {"wav", "audio/wav"},
+    {"ra", "audio/x-realaudio"},
+    {"mp4", "video/mp4"},
+    {"m4v", "video/mp4"},
+    {"webm", "video/webm"},
+    {"ogv", "video/ogg"},
+    {"mpeg", "video/mpeg"},
+    {"mpg", "video/mpeg"},
+    {"mov", "video/quicktime"},
+    {"ts", "video/mp2t"},
+    {"3gp", "video/3gpp"},
+    {"3gpp", "video/3gpp"},
+    {"mkv", "video/x-matroska"},
+    {"flv", "video/x-flv"},
+    {"mng", "video/x-mng"},
+    {"asf", "video/x-ms-asf"},
+    {"asx", "video/x-ms-asf"},
+    {"wmv", "video/x-ms-wmv"},
+    {"avi", "video/x-msvideo"},
+};
+
+#endif
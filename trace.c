@@ -0,0 +1,179 @@
+#include "trace.h"
+#include "config.h"
+#include "utils.h"
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TRACE_TSC 1
+#endif
+
+// The last TRACE_RING_SIZE requests per thread stay here, so a core dump
+// or debugger shows what each worker was doing.
+typedef struct {
+  trace_req_t reqs[TRACE_RING_SIZE];
+  uint64_t head;
+  int fd;
+  uint64_t accept_ticks;
+  uint64_t dequeue_ticks;
+} trace_ring_t;
+
+static _Thread_local trace_ring_t ring;
+
+static double ticks_per_us = 1000.0; // ns clock unless calibrated
+static uint64_t slow_ticks;
+static _Atomic uint64_t slow_window;
+static _Atomic int slow_logged;
+
+static uint64_t mono_ns(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t trace_now(void) {
+#ifdef TRACE_TSC
+  return __rdtsc();
+#else
+  return mono_ns(CLOCK_MONOTONIC_COARSE);
+#endif
+}
+
+void trace_init(uint64_t slow_ms) {
+#ifdef TRACE_TSC
+  uint64_t ns0 = mono_ns(CLOCK_MONOTONIC);
+  uint64_t t0 = __rdtsc();
+  struct timespec nap = {.tv_sec = 0, .tv_nsec = 20 * 1000000};
+  nanosleep(&nap, NULL);
+  uint64_t t1 = __rdtsc();
+  uint64_t ns1 = mono_ns(CLOCK_MONOTONIC);
+  if (ns1 > ns0 && t1 > t0)
+    ticks_per_us = (double)(t1 - t0) * 1000.0 / (double)(ns1 - ns0);
+#endif
+
+  slow_ticks = (uint64_t)(slow_ms * 1000 * ticks_per_us);
+  if (slow_ms > 0)
+    log_info("Logging requests slower than %lums", (unsigned long)slow_ms);
+}
+
+void trace_conn_begin(int fd, uint64_t accept_ticks) {
+  ring.fd = fd;
+  ring.accept_ticks = accept_ticks;
+  ring.dequeue_ticks = trace_now();
+}
+
+void trace_req_begin(void) {
+  trace_req_t *r = &ring.reqs[ring.head % TRACE_RING_SIZE];
+  memset(r->ts, 0, sizeof(r->ts));
+  r->fd = ring.fd;
+
+  // Queue wait belongs to the first request on a connection only
+  if (ring.accept_ticks) {
+    r->ts[TRACE_ACCEPT] = ring.accept_ticks;
+    r->ts[TRACE_DEQUEUE] = ring.dequeue_ticks;
+    ring.accept_ticks = 0;
+  }
+  r->ts[TRACE_READY] = trace_now();
+}
+
+void trace_stage(trace_stage_t stage) {
+  ring.reqs[ring.head % TRACE_RING_SIZE].ts[stage] = trace_now();
+}
+
+static double span_ms(const trace_req_t *r, trace_stage_t from,
+                      trace_stage_t to) {
+  if (!r->ts[from] || !r->ts[to] || r->ts[to] < r->ts[from])
+    return 0;
+  return (r->ts[to] - r->ts[from]) / ticks_per_us / 1000.0;
+}
+
+// Stamps are filled in order, but some stages are skipped (e.g. errors
+// before open); measure each one from the latest stage that was reached.
+static double stage_ms(const trace_req_t *r, trace_stage_t stage) {
+  for (int prev = (int)stage - 1; prev >= 0; prev--) {
+    if (r->ts[prev])
+      return span_ms(r, (trace_stage_t)prev, stage);
+  }
+  return 0;
+}
+
+static bool slow_log_allowed(void) {
+  uint64_t now = time_ms() / 1000;
+  uint64_t window = atomic_load_explicit(&slow_window, memory_order_relaxed);
+  if (window != now &&
+      atomic_compare_exchange_strong(&slow_window, &window, now))
+    atomic_store_explicit(&slow_logged, 0, memory_order_relaxed);
+  return atomic_fetch_add_explicit(&slow_logged, 1, memory_order_relaxed) <
+         TRACE_SLOW_LOG_PER_SEC;
+}
+
+static void req_log(const trace_req_t *r) {
+  trace_stage_t first = r->ts[TRACE_ACCEPT] ? TRACE_ACCEPT : TRACE_READY;
+  if (!slow_ticks || r->ts[TRACE_SEND_DONE] - r->ts[first] < slow_ticks)
+    return;
+  if (!slow_log_allowed())
+    return;
+
+  log_info("Slow request fd=%d %s %s %d total=%.3fms queue=%.3f poll=%.3f "
+           "parse=%.3f resolve=%.3f open=%.3f prepare=%.3f handoff=%.3f "
+           "lane=%.3f send=%.3f",
+           r->fd, r->method, r->path, r->status,
+           span_ms(r, first, TRACE_SEND_DONE),
+           span_ms(r, TRACE_ACCEPT, TRACE_DEQUEUE),
+           span_ms(r, r->ts[TRACE_DEQUEUE] ? TRACE_DEQUEUE : TRACE_READY,
+                   TRACE_READY),
+           stage_ms(r, TRACE_PARSED), stage_ms(r, TRACE_RESOLVED),
+           stage_ms(r, TRACE_OPENED), stage_ms(r, TRACE_SEND_START),
+           span_ms(r, TRACE_SEND_START, TRACE_HANDOFF),
+           span_ms(r, TRACE_HANDOFF, TRACE_LANE_START),
+           stage_ms(r, TRACE_SEND_DONE));
+}
+
+static void req_name(trace_req_t *r, const char *method, const char *path) {
+  snprintf(r->method, sizeof(r->method), "%s", method);
+  snprintf(r->path, sizeof(r->path), "%s", path);
+}
+
+void trace_req_end(const char *method, const char *path, int status) {
+  trace_req_t *r = &ring.reqs[ring.head % TRACE_RING_SIZE];
+  if (!r->ts[TRACE_SEND_DONE])
+    r->ts[TRACE_SEND_DONE] = trace_now();
+  r->status = status;
+  req_name(r, method, path);
+  ring.head++;
+  req_log(r);
+}
+
+// The slot left in this thread's ring shows status 0: handed off.
+void trace_req_detach(trace_req_t *out, const char *method, const char *path) {
+  trace_req_t *r = &ring.reqs[ring.head % TRACE_RING_SIZE];
+  r->ts[TRACE_HANDOFF] = trace_now();
+  r->status = 0;
+  req_name(r, method, path);
+  ring.head++;
+  *out = *r;
+}
+
+void trace_req_open(trace_req_t *r, int fd, const char *method,
+                    const char *path) {
+  memset(r->ts, 0, sizeof(r->ts));
+  r->fd = fd;
+  r->status = 0;
+  req_name(r, method, path);
+  r->ts[TRACE_READY] = r->ts[TRACE_PARSED] = trace_now();
+}
+
+void trace_req_stage(trace_req_t *r, trace_stage_t stage) {
+  r->ts[stage] = trace_now();
+}
+
+void trace_req_finish(trace_req_t *r, int status) {
+  if (!r->ts[TRACE_SEND_DONE])
+    r->ts[TRACE_SEND_DONE] = trace_now();
+  r->status = status;
+  ring.reqs[ring.head++ % TRACE_RING_SIZE] = *r;
+  req_log(r);
+}
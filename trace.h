@@ -0,0 +1,76 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// USDT probes, attachable with e.g.
+//   bpftrace -e 'usdt:./server:server:send_done { @[arg2] = count(); }'
+// They compile to a single nop when <sys/sdt.h> (systemtap-sdt-dev) is
+// available, and to nothing otherwise.
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_PROBE1(name, a) DTRACE_PROBE1(server, name, a)
+#define TRACE_PROBE2(name, a, b) DTRACE_PROBE2(server, name, a, b)
+#define TRACE_PROBE3(name, a, b, c) DTRACE_PROBE3(server, name, a, b, c)
+#endif
+#endif
+
+// sizeof keeps the arguments "used" without evaluating them
+#ifndef TRACE_PROBE1
+#define TRACE_PROBE1(name, a) ((void)sizeof(a))
+#define TRACE_PROBE2(name, a, b) ((void)sizeof(a), (void)sizeof(b))
+#define TRACE_PROBE3(name, a, b, c)                                            \
+  ((void)sizeof(a), (void)sizeof(b), (void)sizeof(c))
+#endif
+
+typedef enum {
+  TRACE_ACCEPT,     // Connection accepted (first request only)
+  TRACE_DEQUEUE,    // Worker picked it up (first request only)
+  TRACE_READY,      // poll() reported the request readable
+  TRACE_PARSED,     // Request line and headers parsed
+  TRACE_RESOLVED,   // Path normalized
+  TRACE_OPENED,     // File opened and stat'ed, or archive entry found
+  TRACE_SEND_START, // Headers about to go out
+  TRACE_HANDOFF,    // Body handed to the bulk lane (large bodies only)
+  TRACE_LANE_START, // Bulk lane began sending it
+  TRACE_SEND_DONE,  // Last byte handed to the kernel
+  TRACE_STAGES
+} trace_stage_t;
+
+#define TRACE_ABORTED -1 // Status of a response whose body was cut short
+
+typedef struct {
+  uint64_t ts[TRACE_STAGES]; // Clock ticks, 0 if the stage was not reached
+  int fd;
+  int status;
+  char method[8];
+  char path[64];
+} trace_req_t;
+
+// Calibrate the clock. Requests slower than slow_ms are logged with their
+// stage breakdown, at most TRACE_SLOW_LOG_PER_SEC per second; 0 disables.
+void trace_init(uint64_t slow_ms);
+
+uint64_t trace_now(void);
+
+// Called by the worker when it dequeues a connection.
+void trace_conn_begin(int fd, uint64_t accept_ticks);
+
+// Per request on the calling thread's current connection.
+void trace_req_begin(void);
+void trace_stage(trace_stage_t stage);
+void trace_req_end(const char *method, const char *path, int status);
+
+// Move the current request off this thread (to the bulk lane), stamping
+// TRACE_HANDOFF. The copy is stamped and finished wherever it is sent.
+void trace_req_detach(trace_req_t *out, const char *method, const char *path);
+// A record kept outside the ring from the start: one per HTTP/2 stream,
+// since a connection's streams interleave. Stamps READY and PARSED.
+void trace_req_open(trace_req_t *r, int fd, const char *method,
+                    const char *path);
+void trace_req_stage(trace_req_t *r, trace_stage_t stage);
+void trace_req_finish(trace_req_t *r, int status);
+
+#endif
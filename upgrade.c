@@ -0,0 +1,174 @@
+#include "upgrade.h"
+#include "config.h"
+#include "utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define ENV_LISTEN_FD "SERVER_LISTEN_FD"
+#define ENV_READY_FD "SERVER_READY_FD"
+
+static char exe_path[PATH_MAX];
+static char start_dir[PATH_MAX];
+static char **exec_argv;
+static cpu_set_t start_cpus; // Restored for the child; -A pins this thread
+static bool have_start_cpus;
+
+// The upgrade in progress, if any.
+static pid_t child_pid = -1;
+static int ready_fd = -1;
+static uint64_t ready_deadline;
+
+static int env_fd(const char *name) {
+  const char *val = getenv(name);
+  if (!val)
+    return -1;
+
+  char *end;
+  long fd = strtol(val, &end, 10);
+  unsetenv(name);
+  if (*end || fd < 0 || fd > INT_MAX || fcntl((int)fd, F_GETFD) < 0)
+    return -1;
+
+  fcntl((int)fd, F_SETFD, FD_CLOEXEC);
+  return (int)fd;
+}
+
+bool upgrade_init(char **argv) {
+  exec_argv = argv;
+  have_start_cpus =
+      sched_getaffinity(0, sizeof(start_cpus), &start_cpus) == 0;
+
+  ssize_t n = readlink("/proc/self/exe", exe_path, sizeof(exe_path) - 1);
+  if (n < 0 || !getcwd(start_dir, sizeof(start_dir))) {
+    log_error("Binary upgrade unavailable: %s", strerror(errno));
+    exe_path[0] = '\0';
+    return false;
+  }
+  exe_path[n] = '\0';
+  return true;
+}
+
+int upgrade_inherited_fd(void) {
+  int fd = env_fd(ENV_LISTEN_FD);
+  if (fd >= 0)
+    log_info("Inherited listening socket (fd %d)", fd);
+  return fd;
+}
+
+void upgrade_ready(void) {
+  int fd = env_fd(ENV_READY_FD);
+  if (fd < 0)
+    return;
+
+  char c = 1;
+  if (write(fd, &c, 1) < 0)
+    log_error("Cannot notify previous process: %s", strerror(errno));
+  close(fd);
+}
+
+int upgrade_start(int listen_fd) {
+  if (!exe_path[0])
+    return -1;
+  if (ready_fd >= 0) {
+    log_info("Upgrade: already in progress");
+    return -1;
+  }
+
+  int ready[2];
+  if (pipe2(ready, O_CLOEXEC) < 0) {
+    log_error("pipe2: %s", strerror(errno));
+    return -1;
+  }
+
+  // Build the child's environment up front: after fork() in a threaded
+  // process only async-signal-safe calls are allowed until exec.
+  size_t env_count = 0;
+  while (environ[env_count])
+    env_count++;
+
+  char **envp = calloc(env_count + 3, sizeof(char *));
+  if (!envp) {
+    close(ready[0]);
+    close(ready[1]);
+    return -1;
+  }
+
+  char listen_env[32];
+  char ready_env[32];
+  snprintf(listen_env, sizeof(listen_env), ENV_LISTEN_FD "=%d", listen_fd);
+  snprintf(ready_env, sizeof(ready_env), ENV_READY_FD "=%d", ready[1]);
+  size_t n = 0;
+  for (size_t i = 0; i < env_count; i++) {
+    if (strncmp(environ[i], ENV_LISTEN_FD "=", sizeof(ENV_LISTEN_FD)) != 0 &&
+        strncmp(environ[i], ENV_READY_FD "=", sizeof(ENV_READY_FD)) != 0)
+      envp[n++] = environ[i];
+  }
+  envp[n++] = listen_env;
+  envp[n++] = ready_env;
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    fcntl(listen_fd, F_SETFD, 0);
+    fcntl(ready[1], F_SETFD, 0);
+    if (have_start_cpus)
+      sched_setaffinity(0, sizeof(start_cpus), &start_cpus);
+    if (chdir(start_dir) == 0)
+      execve(exe_path, exec_argv, envp);
+    _exit(127);
+  }
+
+  free(envp);
+  close(ready[1]);
+
+  if (pid < 0) {
+    log_error("fork: %s", strerror(errno));
+    close(ready[0]);
+    return -1;
+  }
+
+  log_info("Upgrade: started %s (pid %d)", exe_path, (int)pid);
+  child_pid = pid;
+  ready_fd = ready[0];
+  ready_deadline = time_ms() + UPGRADE_READY_MS;
+  return ready_fd;
+}
+
+int upgrade_timeout_ms(void) {
+  if (ready_fd < 0)
+    return -1;
+  uint64_t now = time_ms();
+  return now >= ready_deadline ? 0 : (int)(ready_deadline - now);
+}
+
+bool upgrade_finish(void) {
+  if (ready_fd < 0)
+    return false;
+
+  // Readable means the child wrote its byte or died and closed the pipe.
+  struct pollfd pfd = {.fd = ready_fd, .events = POLLIN};
+  char c = 0;
+  bool ok = poll(&pfd, 1, 0) > 0 && read(ready_fd, &c, 1) == 1 && c == 1;
+  close(ready_fd);
+  ready_fd = -1;
+  pid_t pid = child_pid;
+  child_pid = -1;
+
+  if (!ok) {
+    log_error("Upgrade: new process did not become ready, keep serving");
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return false;
+  }
+
+  log_info("Upgrade: pid %d is accepting, draining", (int)pid);
+  return true;
+}
@@ -0,0 +1,29 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include <stdbool.h>
+
+// Record the binary path, launch directory and CPU mask; call before
+// chdir() and before any pinning.
+bool upgrade_init(char **argv);
+
+// Listening fd handed down by the previous process, or -1.
+int upgrade_inherited_fd(void);
+
+// Tell the previous process we are accepting. No-op on a cold start.
+void upgrade_ready(void);
+
+// Re-exec the binary with listen_fd inherited. Returns an fd that turns
+// readable once the new process reports ready (or dies), or -1. Keep
+// accepting until then, or until upgrade_timeout_ms() reaches 0, and
+// then call upgrade_finish().
+int upgrade_start(int listen_fd);
+
+// Milliseconds left for the pending upgrade; -1 if none.
+int upgrade_timeout_ms(void);
+
+// Collect the pending upgrade, killing a child that never got ready. On
+// true the caller should stop accepting and drain.
+bool upgrade_finish(void);
+
+#endif